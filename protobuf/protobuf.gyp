@@ -62,6 +62,7 @@
         'src/google/protobuf/wire_format_lite.h',
         'src/google/protobuf/wire_format_lite_inl.h',
         'src/google/protobuf/io/coded_stream.h',
+        'src/google/protobuf/io/varint_array.h',
         'src/google/protobuf/io/zero_copy_stream.h',
         'src/google/protobuf/io/zero_copy_stream_impl_lite.h',
 
@@ -77,6 +78,7 @@
         'src/google/protobuf/wire_format_lite.cc',
         'src/google/protobuf/io/coded_stream.cc',
         'src/google/protobuf/io/coded_stream_inl.h',
+        'src/google/protobuf/io/varint_array.cc',
         'src/google/protobuf/io/zero_copy_stream.cc',
         'src/google/protobuf/io/zero_copy_stream_impl_lite.cc',
         '<(config_h_dir)/config.h',
@@ -129,8 +131,8 @@
         'src/google/protobuf/io/zero_copy_stream_impl.h',
 #        'src/google/protobuf/compiler/code_generator.h',
 #        'src/google/protobuf/compiler/command_line_interface.h',
-#        'src/google/protobuf/compiler/importer.h',
-#        'src/google/protobuf/compiler/parser.h',
+        'src/google/protobuf/compiler/importer.h',
+        'src/google/protobuf/compiler/parser.h',
 
         'src/google/protobuf/stubs/strutil.cc',
         'src/google/protobuf/stubs/strutil.h',
@@ -154,8 +156,8 @@
         'src/google/protobuf/io/printer.cc',
         'src/google/protobuf/io/tokenizer.cc',
         'src/google/protobuf/io/zero_copy_stream_impl.cc',
-#        'src/google/protobuf/compiler/importer.cc',
-#        'src/google/protobuf/compiler/parser.cc',
+        'src/google/protobuf/compiler/importer.cc',
+        'src/google/protobuf/compiler/parser.cc',
       ],
       'dependencies': [
         'protobuf_lite',
@@ -325,6 +325,64 @@ bool EncodedDescriptorDatabase::AddCopy(
   return Add(copy, size);
 }
 
+bool EncodedDescriptorDatabase::AddIndexed(
+    const FileDescriptorProto& index,
+    const void* encoded_file_descriptor, int size) {
+  return index_.AddFile(index, make_pair(encoded_file_descriptor, size));
+}
+
+namespace {
+
+void CopyExtensionIndex(const FieldDescriptorProto& extension,
+                        FieldDescriptorProto* index) {
+  index->set_name(extension.name());
+  index->set_number(extension.number());
+  index->set_extendee(extension.extendee());
+}
+
+bool HasExtensions(const DescriptorProto& message_type) {
+  if (message_type.extension_size() > 0) return true;
+  for (int i = 0; i < message_type.nested_type_size(); i++) {
+    if (HasExtensions(message_type.nested_type(i))) return true;
+  }
+  return false;
+}
+
+void CopyMessageIndex(const DescriptorProto& message_type,
+                      DescriptorProto* index) {
+  index->set_name(message_type.name());
+  // Nested types only matter for the extensions declared in them.
+  for (int i = 0; i < message_type.nested_type_size(); i++) {
+    if (HasExtensions(message_type.nested_type(i))) {
+      CopyMessageIndex(message_type.nested_type(i), index->add_nested_type());
+    }
+  }
+  for (int i = 0; i < message_type.extension_size(); i++) {
+    CopyExtensionIndex(message_type.extension(i), index->add_extension());
+  }
+}
+
+}  // namespace
+
+void EncodedDescriptorDatabase::MakeIndex(const FileDescriptorProto& file,
+                                          FileDescriptorProto* index) {
+  index->Clear();
+  index->set_name(file.name());
+  if (file.has_package()) index->set_package(file.package());
+  for (int i = 0; i < file.message_type_size(); i++) {
+    CopyMessageIndex(file.message_type(i), index->add_message_type());
+  }
+  for (int i = 0; i < file.enum_type_size(); i++) {
+    index->add_enum_type()->set_name(file.enum_type(i).name());
+  }
+  for (int i = 0; i < file.extension_size(); i++) {
+    CopyExtensionIndex(file.extension(i), index->add_extension());
+  }
+  for (int i = 0; i < file.service_size(); i++) {
+    index->add_service()->set_name(file.service(i).name());
+  }
+}
+
 bool EncodedDescriptorDatabase::FindFileByName(
     const string& filename,
     FileDescriptorProto* output) {
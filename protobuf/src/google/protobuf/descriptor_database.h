@@ -280,6 +280,19 @@ class LIBPROTOBUF_EXPORT EncodedDescriptorDatabase : public DescriptorDatabase {
   // need to keep it around.
   bool AddCopy(const void* encoded_file_descriptor, int size);
 
+  // Like Add(), but indexes the file by "index", as made by MakeIndex(),
+  // instead of parsing the encoded descriptor, which is only parsed when
+  // the file is looked up.  Saving the index alongside the encoded files
+  // lets a large set of them be added without parsing each one.
+  bool AddIndexed(const FileDescriptorProto& index,
+                  const void* encoded_file_descriptor, int size);
+
+  // Copies the parts of "file" that the database indexes by -- its name
+  // and package, the names of the types and services it defines, and its
+  // extensions -- to "index".
+  static void MakeIndex(const FileDescriptorProto& file,
+                        FileDescriptorProto* index);
+
   // Like FindFileContainingSymbol but returns only the name of the file.
   bool FindNameOfFileContainingSymbol(const string& symbol_name,
                                       string* output);
@@ -514,6 +514,50 @@ TEST(EncodedDescriptorDatabaseExtraTest, FindNameOfFileContainingSymbol) {
   EXPECT_FALSE(db.FindNameOfFileContainingSymbol("baz.Baz", &filename));
 }
 
+TEST(EncodedDescriptorDatabaseExtraTest, AddIndexed) {
+  FileDescriptorProto file;
+  EXPECT_TRUE(TextFormat::ParseFromString(
+    "name: \"foo.proto\" package: \"foo\" "
+    "message_type { name: \"Foo\" "
+    "  field { name: \"x\" number: 1 label: LABEL_OPTIONAL type: TYPE_INT32 }"
+    "  extension_range { start: 10 end: 20 } "
+    "  nested_type { name: \"Nested\" "
+    "    extension { name: \"nested_ext\" extendee: \".foo.Foo\" number: 11 "
+    "                label: LABEL_OPTIONAL type: TYPE_INT32 } } } "
+    "enum_type { name: \"E\" value { name: \"E_A\" number: 1 } } "
+    "extension { name: \"ext\" extendee: \".foo.Foo\" number: 10 "
+    "            label: LABEL_OPTIONAL type: TYPE_INT32 } "
+    "service { name: \"S\" }",
+    &file));
+
+  FileDescriptorProto index;
+  EncodedDescriptorDatabase::MakeIndex(file, &index);
+  EXPECT_LT(index.ByteSize(), file.ByteSize());
+
+  string data = file.SerializeAsString();
+  EncodedDescriptorDatabase db;
+  EXPECT_TRUE(db.AddIndexed(index, data.data(), data.size()));
+
+  // Lookups return the whole file, not the index.
+  FileDescriptorProto found;
+  EXPECT_TRUE(db.FindFileByName("foo.proto", &found));
+  EXPECT_EQ(file.DebugString(), found.DebugString());
+
+  const char* symbols[] = { "foo.Foo", "foo.Foo.x", "foo.E", "foo.ext", "foo.S" };
+  for (int i = 0; i < GOOGLE_ARRAYSIZE(symbols); i++) {
+    found.Clear();
+    EXPECT_TRUE(db.FindFileContainingSymbol(symbols[i], &found)) << symbols[i];
+    EXPECT_EQ("foo.proto", found.name());
+  }
+  EXPECT_FALSE(db.FindFileContainingSymbol("foo.Bar", &found));
+
+  EXPECT_TRUE(db.FindFileContainingExtension("foo.Foo", 10, &found));
+  EXPECT_TRUE(db.FindFileContainingExtension("foo.Foo", 11, &found));
+  vector<int> numbers;
+  EXPECT_TRUE(db.FindAllExtensionNumbers("foo.Foo", &numbers));
+  EXPECT_EQ(2, numbers.size());
+}
+
 // ===================================================================
 
 class MergedDescriptorDatabaseTest : public testing::Test {
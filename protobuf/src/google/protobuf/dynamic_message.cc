@@ -157,10 +157,89 @@ inline int AlignOffset(int offset) {
 
 #define bitsizeof(T) (sizeof(T) * 8)
 
+// Every DynamicMessage is preceded by the arena it was allocated from, or
+// NULL if it came from the heap, so that operator delete knows what to do.
+static const int kMessageHeaderSize = AlignOffset(sizeof(DynamicMessageArena*));
+
+#if defined(_MSC_VER)
+#define GOOGLE_PROTOBUF_THREAD_LOCAL __declspec(thread)
+#else
+#define GOOGLE_PROTOBUF_THREAD_LOCAL __thread
+#endif
+
+GOOGLE_PROTOBUF_THREAD_LOCAL DynamicMessageArena* current_arena = NULL;
+
 }  // namespace
 
 // ===================================================================
 
+struct DynamicMessageArena::Block {
+  Block* next;
+  int size;
+};
+
+const int DynamicMessageArena::kBlockHeaderSize = AlignOffset(sizeof(Block));
+
+DynamicMessageArena::DynamicMessageArena(int block_size)
+  : blocks_(NULL), ptr_(NULL), limit_(NULL),
+    block_size_(block_size), space_allocated_(0) {
+}
+
+DynamicMessageArena::~DynamicMessageArena() {
+  while (blocks_ != NULL) {
+    Block* next = blocks_->next;
+    operator delete(blocks_);
+    blocks_ = next;
+  }
+}
+
+void* DynamicMessageArena::Allocate(int size) {
+  size = AlignOffset(size);
+  if (limit_ - ptr_ < size) NewBlock(size);
+  void* result = ptr_;
+  ptr_ += size;
+  return result;
+}
+
+void DynamicMessageArena::NewBlock(int min_size) {
+  int size = max(block_size_, min_size);
+  Block* block = reinterpret_cast<Block*>(operator new(kBlockHeaderSize + size));
+  block->next = blocks_;
+  block->size = size;
+  blocks_ = block;
+  space_allocated_ += size;
+  ptr_ = reinterpret_cast<char*>(block) + kBlockHeaderSize;
+  limit_ = ptr_ + size;
+}
+
+void DynamicMessageArena::Reset() {
+  if (blocks_ == NULL) return;
+  // The first block is the last one in the list.
+  while (blocks_->next != NULL) {
+    Block* next = blocks_->next;
+    space_allocated_ -= blocks_->size;
+    operator delete(blocks_);
+    blocks_ = next;
+  }
+  ptr_ = reinterpret_cast<char*>(blocks_) + kBlockHeaderSize;
+  limit_ = ptr_ + blocks_->size;
+}
+
+DynamicMessageArena::Scope::Scope(DynamicMessageArena* arena)
+  : previous_(current_arena) {
+  current_arena = arena;
+}
+
+DynamicMessageArena::Scope::~Scope() {
+  current_arena = previous_;
+}
+
+DynamicMessageArena* DynamicMessageArena::current() {
+  return current_arena;
+}
+
+// ===================================================================
+
 class DynamicMessage : public Message {
  public:
   struct TypeInfo {
@@ -184,6 +263,11 @@ class DynamicMessage : public Message {
   DynamicMessage(const TypeInfo* type_info);
   ~DynamicMessage();
 
+  // Returns zeroed storage for a DynamicMessage of the given size, taken
+  // from the arena if it is non-NULL.
+  static void* Allocate(int size, DynamicMessageArena* arena);
+  static void operator delete(void* ptr);
+
   // Called on the prototype after construction to initialize message fields.
   void CrossLinkPrototypes();
 
@@ -402,9 +486,25 @@ void DynamicMessage::CrossLinkPrototypes() {
   }
 }
 
+void* DynamicMessage::Allocate(int size, DynamicMessageArena* arena) {
+  uint8* base = reinterpret_cast<uint8*>(
+    arena != NULL ? arena->Allocate(kMessageHeaderSize + size)
+                  : ::operator new(kMessageHeaderSize + size));
+  *reinterpret_cast<DynamicMessageArena**>(base) = arena;
+  base += kMessageHeaderSize;
+  memset(base, 0, size);
+  return base;
+}
+
+void DynamicMessage::operator delete(void* ptr) {
+  uint8* base = reinterpret_cast<uint8*>(ptr) - kMessageHeaderSize;
+  if (*reinterpret_cast<DynamicMessageArena**>(base) == NULL) {
+    ::operator delete(base);
+  }
+}
+
 Message* DynamicMessage::New() const {
-  void* new_base = reinterpret_cast<uint8*>(operator new(type_info_->size));
-  memset(new_base, 0, type_info_->size);
+  void* new_base = Allocate(type_info_->size, current_arena);
   return new(new_base) DynamicMessage(type_info_);
 }
 
@@ -529,9 +629,9 @@ const Message* DynamicMessageFactory::GetPrototypeNoLock(
   size = AlignOffset(size);
   type_info->size = size;
 
-  // Allocate the prototype.
-  void* base = operator new(size);
-  memset(base, 0, size);
+  // Allocate the prototype.  It outlives any arena, so it always comes from
+  // the heap.
+  void* base = DynamicMessage::Allocate(size, NULL);
   DynamicMessage* prototype = new(base) DynamicMessage(type_info);
   type_info->prototype.reset(prototype);
 
@@ -48,6 +48,66 @@ namespace protobuf {
 class Descriptor;        // descriptor.h
 class DescriptorPool;    // descriptor.h
 
+// A bump allocator for short-lived DynamicMessage trees.
+//
+// While a DynamicMessageArena::Scope is active on a thread, every
+// DynamicMessage created on that thread by New() -- including the
+// sub-messages a parse creates -- takes its storage from the arena.
+// Deleting such a message still runs its destructor, which releases its
+// strings and repeated field buffers (those always live on the heap), but
+// leaves the message's own storage to the arena, which frees all of it at
+// once in Reset() or in its destructor.  Every message allocated from an
+// arena must be deleted before the arena is reset.
+//
+// Prototypes are never allocated from an arena.  An arena is not
+// thread-safe; use one per thread.
+class LIBPROTOBUF_EXPORT DynamicMessageArena {
+ public:
+  // Storage is grabbed from the heap in blocks of at least block_size bytes.
+  explicit DynamicMessageArena(int block_size = 8192);
+  ~DynamicMessageArena();
+
+  // Returns size bytes of storage, aligned for any type.
+  void* Allocate(int size);
+
+  // Releases everything allocated so far.  The first block is kept for
+  // reuse.
+  void Reset();
+
+  // Total number of bytes currently held from the heap.
+  int SpaceAllocated() const { return space_allocated_; }
+
+  // Makes the given arena (or NULL for the heap) current on this thread
+  // for the lifetime of the Scope.  Scopes nest.
+  class LIBPROTOBUF_EXPORT Scope {
+   public:
+    explicit Scope(DynamicMessageArena* arena);
+    ~Scope();
+
+   private:
+    DynamicMessageArena* previous_;
+
+    GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Scope);
+  };
+
+  // The arena of the innermost Scope on this thread, or NULL.
+  static DynamicMessageArena* current();
+
+ private:
+  struct Block;
+  static const int kBlockHeaderSize;
+
+  Block* blocks_;  // most recent first
+  char* ptr_;
+  char* limit_;
+  int block_size_;
+  int space_allocated_;
+
+  void NewBlock(int min_size);
+
+  GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(DynamicMessageArena);
+};
+
 // Constructs implementations of Message which can emulate types which are not
 // known at compile-time.
 //
@@ -158,5 +158,28 @@ TEST_F(DynamicMessageTest, SpaceUsed) {
   EXPECT_LT(initial_space_used, message->SpaceUsed());
 }
 
+TEST_F(DynamicMessageTest, Arena) {
+  // Check that messages built inside an arena scope, sub-messages included,
+  // work the same and can be deleted and reset repeatedly.
+  DynamicMessageArena arena(256);
+  TestUtil::ReflectionTester reflection_tester(descriptor_);
+
+  for (int i = 0; i < 3; i++) {
+    DynamicMessageArena::Scope scope(&arena);
+    Message* message = prototype_->New();
+    reflection_tester.SetAllFieldsViaReflection(message);
+    reflection_tester.ExpectAllFieldsSetViaReflection(*message);
+    EXPECT_LT(0, arena.SpaceAllocated());
+    delete message;
+    arena.Reset();
+  }
+
+  // Outside of any scope, messages come from the heap again.
+  EXPECT_TRUE(DynamicMessageArena::current() == NULL);
+  scoped_ptr<Message> message(prototype_->New());
+  reflection_tester.SetAllFieldsViaReflection(message.get());
+  reflection_tester.ExpectAllFieldsSetViaReflection(*message);
+}
+
 }  // namespace protobuf
 }  // namespace google
@@ -1089,6 +1089,32 @@ const FieldDescriptor* GeneratedMessageReflection::FindKnownExtensionByNumber(
   return descriptor_pool_->FindExtensionByNumber(descriptor_, number);
 }
 
+// -------------------------------------------------------------------
+
+namespace {
+
+// Repeated fields other than extensions are stored in place, as a
+// RepeatedField<T> for the primitive types.
+bool IsRawRepeatedPrimitive(const FieldDescriptor* field) {
+  return field->is_repeated() && !field->is_extension() &&
+         field->cpp_type() != FieldDescriptor::CPPTYPE_STRING &&
+         field->cpp_type() != FieldDescriptor::CPPTYPE_MESSAGE;
+}
+
+}  // namespace
+
+const void* GeneratedMessageReflection::GetRawRepeatedPrimitive(
+    const Message& message, const FieldDescriptor* field) const {
+  if (!IsRawRepeatedPrimitive(field)) return NULL;
+  return &GetRaw<char>(message, field);
+}
+
+void* GeneratedMessageReflection::MutableRawRepeatedPrimitive(
+    Message* message, const FieldDescriptor* field) const {
+  if (!IsRawRepeatedPrimitive(field)) return NULL;
+  return MutableRaw<char>(message, field);
+}
+
 // ===================================================================
 // Some private helpers.
 
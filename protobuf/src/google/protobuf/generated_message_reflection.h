@@ -270,6 +270,11 @@ class LIBPROTOBUF_EXPORT GeneratedMessageReflection : public Reflection {
   const FieldDescriptor* FindKnownExtensionByName(const string& name) const;
   const FieldDescriptor* FindKnownExtensionByNumber(int number) const;
 
+  const void* GetRawRepeatedPrimitive(const Message& message,
+                                      const FieldDescriptor* field) const;
+  void* MutableRawRepeatedPrimitive(Message* message,
+                                    const FieldDescriptor* field) const;
+
  private:
   friend class GeneratedMessage;
 
@@ -0,0 +1,638 @@
+// Protocol Buffers - Google's data interchange format
+// Copyright 2008 Google Inc.  All rights reserved.
+// http://code.google.com/p/protobuf/
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+#include <google/protobuf/io/varint_array.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/stubs/once.h>
+
+#include <string.h>
+
+// SSE2 is part of x86-64 and selected at compile time.  AVX2 kernels are
+// compiled with a target attribute and picked at runtime, which needs
+// GCC 4.9 or a clang that supports the attribute.
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2 1
+#include <emmintrin.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#if defined(__clang__)
+#if defined(__has_attribute)
+#if __has_attribute(target)
+#define GOOGLE_PROTOBUF_VARINT_ARRAY_AVX2 1
+#endif
+#endif
+#elif __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)
+#define GOOGLE_PROTOBUF_VARINT_ARRAY_AVX2 1
+#endif
+#endif
+
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_AVX2
+#include <immintrin.h>
+#define GOOGLE_PROTOBUF_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif  // SSE2
+
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+
+namespace google {
+namespace protobuf {
+namespace io {
+
+namespace {
+
+const int kMaxVarintBytes = 10;
+
+// Decodes the varint at "p", which must end before "end".
+inline const uint8* ReadVarint(const uint8* p, const uint8* end,
+                               uint64* value) {
+  uint64 result = 0;
+  for (int i = 0; i < kMaxVarintBytes; i++) {
+    if (p == end) return NULL;
+    uint8 b = *p++;
+    result |= static_cast<uint64>(b & 0x7F) << (7 * i);
+    if (!(b & 0x80)) {
+      *value = result;
+      return p;
+    }
+  }
+  return NULL;  // too long
+}
+
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+inline int CountTrailingZeros(uint32 mask) {
+#if defined(__GNUC__)
+  return __builtin_ctz(mask);
+#elif defined(_MSC_VER)
+  unsigned long index;
+  _BitScanForward(&index, mask);
+  return static_cast<int>(index);
+#else
+  int n = 0;
+  while (!(mask & 1)) { mask >>= 1; n++; }
+  return n;
+#endif
+}
+
+inline int PopCount(uint32 mask) {
+#if defined(__GNUC__)
+  return __builtin_popcount(mask);
+#else
+  mask = mask - ((mask >> 1) & 0x55555555);
+  mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+  return static_cast<int>((((mask + (mask >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#endif
+}
+#endif
+
+// Scalar kernels ----------------------------------------------------
+// These also finish off whatever the vector kernels leave over.
+
+int CountVarintsScalar(const uint8* p, const uint8* end) {
+  int count = 0;
+  for (; p < end; ++p) {
+    if (!(*p & 0x80)) count++;
+  }
+  return count;
+}
+
+const uint8* ReadVarint32ArrayScalar(const uint8* p, const uint8* end,
+                                     int count, uint32* values) {
+  for (int i = 0; i < count; i++) {
+    uint64 value;
+    p = ReadVarint(p, end, &value);
+    if (p == NULL) return NULL;
+    values[i] = static_cast<uint32>(value);
+  }
+  return p;
+}
+
+const uint8* ReadVarint64ArrayScalar(const uint8* p, const uint8* end,
+                                     int count, uint64* values) {
+  for (int i = 0; i < count; i++) {
+    p = ReadVarint(p, end, &values[i]);
+    if (p == NULL) return NULL;
+  }
+  return p;
+}
+
+void ZigZagDecode32ArrayScalar(uint32* values, int count) {
+  for (int i = 0; i < count; i++) {
+    values[i] = (values[i] >> 1) ^ -(values[i] & 1);
+  }
+}
+
+void ZigZagDecode64ArrayScalar(uint64* values, int count) {
+  for (int i = 0; i < count; i++) {
+    values[i] = (values[i] >> 1) ^ -(values[i] & 1);
+  }
+}
+
+void ZigZagEncode32ArrayScalar(const int32* values, int count,
+                               uint32* encoded) {
+  for (int i = 0; i < count; i++) {
+    encoded[i] = (static_cast<uint32>(values[i]) << 1) ^
+                 static_cast<uint32>(values[i] >> 31);
+  }
+}
+
+void ZigZagEncode64ArrayScalar(const int64* values, int count,
+                               uint64* encoded) {
+  for (int i = 0; i < count; i++) {
+    encoded[i] = (static_cast<uint64>(values[i]) << 1) ^
+                 static_cast<uint64>(values[i] >> 63);
+  }
+}
+
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+// SSE2 kernels ------------------------------------------------------
+// The decoders look at 16 bytes at a time: if none has the continuation
+// bit, they are 16 single-byte varints and are widened in registers.
+// Otherwise the single-byte varints in front of the first longer one are
+// copied and that one is decoded on its own.
+
+int CountVarintsSSE2(const uint8* p, const uint8* end) {
+  int count = 0;
+  for (; end - p >= 16; p += 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    count += 16 - PopCount(_mm_movemask_epi8(bytes));
+  }
+  return count + CountVarintsScalar(p, end);
+}
+
+const uint8* ReadVarint32ArraySSE2(const uint8* p, const uint8* end,
+                                   int count, uint32* values) {
+  const __m128i zero = _mm_setzero_si128();
+  while (count >= 16 && end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    uint32 mask = _mm_movemask_epi8(bytes);
+    if (mask == 0) {
+      __m128i low = _mm_unpacklo_epi8(bytes, zero);
+      __m128i high = _mm_unpackhi_epi8(bytes, zero);
+      __m128i* out = reinterpret_cast<__m128i*>(values);
+      _mm_storeu_si128(out, _mm_unpacklo_epi16(low, zero));
+      _mm_storeu_si128(out + 1, _mm_unpackhi_epi16(low, zero));
+      _mm_storeu_si128(out + 2, _mm_unpacklo_epi16(high, zero));
+      _mm_storeu_si128(out + 3, _mm_unpackhi_epi16(high, zero));
+      p += 16;
+      values += 16;
+      count -= 16;
+    } else {
+      int singles = CountTrailingZeros(mask);
+      for (int i = 0; i < singles; i++) values[i] = p[i];
+      uint64 value;
+      p = ReadVarint(p + singles, end, &value);
+      if (p == NULL) return NULL;
+      values[singles] = static_cast<uint32>(value);
+      values += singles + 1;
+      count -= singles + 1;
+    }
+  }
+  return ReadVarint32ArrayScalar(p, end, count, values);
+}
+
+const uint8* ReadVarint64ArraySSE2(const uint8* p, const uint8* end,
+                                   int count, uint64* values) {
+  const __m128i zero = _mm_setzero_si128();
+  while (count >= 16 && end - p >= 16) {
+    __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    uint32 mask = _mm_movemask_epi8(bytes);
+    if (mask == 0) {
+      __m128i* out = reinterpret_cast<__m128i*>(values);
+      __m128i halves[2] = {
+        _mm_unpacklo_epi8(bytes, zero), _mm_unpackhi_epi8(bytes, zero)
+      };
+      for (int i = 0; i < 2; i++) {
+        __m128i low = _mm_unpacklo_epi16(halves[i], zero);
+        __m128i high = _mm_unpackhi_epi16(halves[i], zero);
+        _mm_storeu_si128(out++, _mm_unpacklo_epi32(low, zero));
+        _mm_storeu_si128(out++, _mm_unpackhi_epi32(low, zero));
+        _mm_storeu_si128(out++, _mm_unpacklo_epi32(high, zero));
+        _mm_storeu_si128(out++, _mm_unpackhi_epi32(high, zero));
+      }
+      p += 16;
+      values += 16;
+      count -= 16;
+    } else {
+      int singles = CountTrailingZeros(mask);
+      for (int i = 0; i < singles; i++) values[i] = p[i];
+      p = ReadVarint(p + singles, end, &values[singles]);
+      if (p == NULL) return NULL;
+      values += singles + 1;
+      count -= singles + 1;
+    }
+  }
+  return ReadVarint64ArrayScalar(p, end, count, values);
+}
+
+void ZigZagDecode32ArraySSE2(uint32* values, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set1_epi32(1);
+  for (; count >= 4; values += 4, count -= 4) {
+    __m128i* p = reinterpret_cast<__m128i*>(values);
+    __m128i v = _mm_loadu_si128(p);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_srli_epi32(v, 1),
+        _mm_sub_epi32(zero, _mm_and_si128(v, one))));
+  }
+  ZigZagDecode32ArrayScalar(values, count);
+}
+
+void ZigZagDecode64ArraySSE2(uint64* values, int count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i one = _mm_set_epi32(0, 1, 0, 1);
+  for (; count >= 2; values += 2, count -= 2) {
+    __m128i* p = reinterpret_cast<__m128i*>(values);
+    __m128i v = _mm_loadu_si128(p);
+    _mm_storeu_si128(p, _mm_xor_si128(_mm_srli_epi64(v, 1),
+        _mm_sub_epi64(zero, _mm_and_si128(v, one))));
+  }
+  ZigZagDecode64ArrayScalar(values, count);
+}
+
+void ZigZagEncode32ArraySSE2(const int32* values, int count,
+                             uint32* encoded) {
+  for (; count >= 4; values += 4, encoded += 4, count -= 4) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(encoded),
+        _mm_xor_si128(_mm_slli_epi32(v, 1), _mm_srai_epi32(v, 31)));
+  }
+  ZigZagEncode32ArrayScalar(values, count, encoded);
+}
+
+void ZigZagEncode64ArraySSE2(const int64* values, int count,
+                             uint64* encoded) {
+  for (; count >= 2; values += 2, encoded += 2, count -= 2) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(values));
+    // SSE2 has no 64-bit arithmetic shift: spread the high words' signs
+    __m128i sign = _mm_shuffle_epi32(_mm_srai_epi32(v, 31),
+                                     _MM_SHUFFLE(3, 3, 1, 1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(encoded),
+        _mm_xor_si128(_mm_slli_epi64(v, 1), sign));
+  }
+  ZigZagEncode64ArrayScalar(values, count, encoded);
+}
+
+// The encoders narrow 16 values at a time when all of them fit in a byte.
+
+inline bool AllBelow128(__m128i any, __m128i high_bits) {
+  return _mm_movemask_epi8(_mm_cmpeq_epi32(_mm_and_si128(any, high_bits),
+                                           _mm_setzero_si128())) == 0xFFFF;
+}
+
+// Narrows 16 values below 128, in four vectors of 32-bit lanes.
+inline void Store16Bytes(__m128i a, __m128i b, __m128i c, __m128i d,
+                         uint8* target) {
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(target),
+      _mm_packus_epi16(_mm_packs_epi32(a, b), _mm_packs_epi32(c, d)));
+}
+
+bool Narrow32(const uint32* values, uint8* target) {
+  const __m128i* p = reinterpret_cast<const __m128i*>(values);
+  __m128i a = _mm_loadu_si128(p);
+  __m128i b = _mm_loadu_si128(p + 1);
+  __m128i c = _mm_loadu_si128(p + 2);
+  __m128i d = _mm_loadu_si128(p + 3);
+  __m128i any = _mm_or_si128(_mm_or_si128(a, b), _mm_or_si128(c, d));
+  if (!AllBelow128(any, _mm_set1_epi32(~0x7F))) return false;
+  Store16Bytes(a, b, c, d, target);
+  return true;
+}
+
+bool Narrow64(const uint64* values, uint8* target) {
+  const __m128i* p = reinterpret_cast<const __m128i*>(values);
+  __m128i v[8];
+  __m128i any = _mm_setzero_si128();
+  for (int i = 0; i < 8; i++) {
+    v[i] = _mm_loadu_si128(p + i);
+    any = _mm_or_si128(any, v[i]);
+  }
+  if (!AllBelow128(any, _mm_set_epi32(-1, ~0x7F, -1, ~0x7F))) return false;
+  // the low words of each pair of vectors
+  __m128i low[4];
+  for (int i = 0; i < 4; i++) {
+    low[i] = _mm_unpacklo_epi64(
+        _mm_shuffle_epi32(v[2 * i], _MM_SHUFFLE(2, 0, 2, 0)),
+        _mm_shuffle_epi32(v[2 * i + 1], _MM_SHUFFLE(2, 0, 2, 0)));
+  }
+  Store16Bytes(low[0], low[1], low[2], low[3], target);
+  return true;
+}
+#endif  // SSE2
+
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_AVX2
+// AVX2 kernels ------------------------------------------------------
+// As above, 32 bytes at a time.  They finish with the SSE2 ones.
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+int CountVarintsAVX2(const uint8* p, const uint8* end) {
+  int count = 0;
+  for (; end - p >= 32; p += 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    count += 32 - PopCount(static_cast<uint32>(_mm256_movemask_epi8(bytes)));
+  }
+  return count + CountVarintsSSE2(p, end);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+const uint8* ReadVarint32ArrayAVX2(const uint8* p, const uint8* end,
+                                   int count, uint32* values) {
+  while (count >= 32 && end - p >= 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    uint32 mask = static_cast<uint32>(_mm256_movemask_epi8(bytes));
+    if (mask == 0) {
+      for (int i = 0; i < 4; i++) {
+        __m128i eight = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p + 8 * i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + 8 * i),
+                            _mm256_cvtepu8_epi32(eight));
+      }
+      p += 32;
+      values += 32;
+      count -= 32;
+    } else {
+      int singles = CountTrailingZeros(mask);
+      for (int i = 0; i < singles; i++) values[i] = p[i];
+      uint64 value;
+      p = ReadVarint(p + singles, end, &value);
+      if (p == NULL) return NULL;
+      values[singles] = static_cast<uint32>(value);
+      values += singles + 1;
+      count -= singles + 1;
+    }
+  }
+  return ReadVarint32ArraySSE2(p, end, count, values);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+const uint8* ReadVarint64ArrayAVX2(const uint8* p, const uint8* end,
+                                   int count, uint64* values) {
+  while (count >= 32 && end - p >= 32) {
+    __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p));
+    uint32 mask = static_cast<uint32>(_mm256_movemask_epi8(bytes));
+    if (mask == 0) {
+      for (int i = 0; i < 8; i++) {
+        int32 four;
+        memcpy(&four, p + 4 * i, sizeof(four));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(values + 4 * i),
+                            _mm256_cvtepu8_epi64(_mm_cvtsi32_si128(four)));
+      }
+      p += 32;
+      values += 32;
+      count -= 32;
+    } else {
+      int singles = CountTrailingZeros(mask);
+      for (int i = 0; i < singles; i++) values[i] = p[i];
+      p = ReadVarint(p + singles, end, &values[singles]);
+      if (p == NULL) return NULL;
+      values += singles + 1;
+      count -= singles + 1;
+    }
+  }
+  return ReadVarint64ArraySSE2(p, end, count, values);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+void ZigZagDecode32ArrayAVX2(uint32* values, int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi32(1);
+  for (; count >= 8; values += 8, count -= 8) {
+    __m256i* p = reinterpret_cast<__m256i*>(values);
+    __m256i v = _mm256_loadu_si256(p);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_srli_epi32(v, 1),
+        _mm256_sub_epi32(zero, _mm256_and_si256(v, one))));
+  }
+  ZigZagDecode32ArraySSE2(values, count);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+void ZigZagDecode64ArrayAVX2(uint64* values, int count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i one = _mm256_set1_epi64x(1);
+  for (; count >= 4; values += 4, count -= 4) {
+    __m256i* p = reinterpret_cast<__m256i*>(values);
+    __m256i v = _mm256_loadu_si256(p);
+    _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_srli_epi64(v, 1),
+        _mm256_sub_epi64(zero, _mm256_and_si256(v, one))));
+  }
+  ZigZagDecode64ArraySSE2(values, count);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+void ZigZagEncode32ArrayAVX2(const int32* values, int count,
+                             uint32* encoded) {
+  for (; count >= 8; values += 8, encoded += 8, count -= 8) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(encoded),
+        _mm256_xor_si256(_mm256_slli_epi32(v, 1), _mm256_srai_epi32(v, 31)));
+  }
+  ZigZagEncode32ArraySSE2(values, count, encoded);
+}
+
+GOOGLE_PROTOBUF_TARGET_AVX2
+void ZigZagEncode64ArrayAVX2(const int64* values, int count,
+                             uint64* encoded) {
+  for (; count >= 4; values += 4, encoded += 4, count -= 4) {
+    __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(values));
+    __m256i sign = _mm256_shuffle_epi32(_mm256_srai_epi32(v, 31),
+                                        _MM_SHUFFLE(3, 3, 1, 1));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(encoded),
+        _mm256_xor_si256(_mm256_slli_epi64(v, 1), sign));
+  }
+  ZigZagEncode64ArraySSE2(values, count, encoded);
+}
+
+bool HasAVX2() {
+  __builtin_cpu_init();
+  return __builtin_cpu_supports("avx2");
+}
+#endif  // AVX2
+
+// Runtime dispatch --------------------------------------------------
+
+struct Kernels {
+  int (*count_varints)(const uint8*, const uint8*);
+  const uint8* (*read_varint32_array)(const uint8*, const uint8*, int, uint32*);
+  const uint8* (*read_varint64_array)(const uint8*, const uint8*, int, uint64*);
+  void (*zigzag_decode32_array)(uint32*, int);
+  void (*zigzag_decode64_array)(uint64*, int);
+  void (*zigzag_encode32_array)(const int32*, int, uint32*);
+  void (*zigzag_encode64_array)(const int64*, int, uint64*);
+};
+
+Kernels kernels;
+GOOGLE_PROTOBUF_DECLARE_ONCE(kernels_once);
+
+void InitKernels() {
+#define SET_KERNELS(SUFFIX)                                                   \
+  kernels.count_varints = &CountVarints##SUFFIX;                              \
+  kernels.read_varint32_array = &ReadVarint32Array##SUFFIX;                   \
+  kernels.read_varint64_array = &ReadVarint64Array##SUFFIX;                   \
+  kernels.zigzag_decode32_array = &ZigZagDecode32Array##SUFFIX;               \
+  kernels.zigzag_decode64_array = &ZigZagDecode64Array##SUFFIX;               \
+  kernels.zigzag_encode32_array = &ZigZagEncode32Array##SUFFIX;               \
+  kernels.zigzag_encode64_array = &ZigZagEncode64Array##SUFFIX
+
+  SET_KERNELS(Scalar);
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+  SET_KERNELS(SSE2);
+#endif
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_AVX2
+  if (HasAVX2()) {
+    SET_KERNELS(AVX2);
+  }
+#endif
+#undef SET_KERNELS
+}
+
+inline const Kernels& GetKernels() {
+  ::google::protobuf::GoogleOnceInit(&kernels_once, &InitKernels);
+  return kernels;
+}
+
+}  // namespace
+
+int CountVarints(const uint8* begin, const uint8* end) {
+  return GetKernels().count_varints(begin, end);
+}
+
+const uint8* ReadVarint32Array(const uint8* begin, const uint8* end,
+                               int count, uint32* values) {
+  return GetKernels().read_varint32_array(begin, end, count, values);
+}
+
+const uint8* ReadVarint64Array(const uint8* begin, const uint8* end,
+                               int count, uint64* values) {
+  return GetKernels().read_varint64_array(begin, end, count, values);
+}
+
+void ZigZagDecode32Array(uint32* values, int count) {
+  GetKernels().zigzag_decode32_array(values, count);
+}
+
+void ZigZagDecode64Array(uint64* values, int count) {
+  GetKernels().zigzag_decode64_array(values, count);
+}
+
+void ZigZagEncode32Array(const int32* values, int count, uint32* encoded) {
+  GetKernels().zigzag_encode32_array(values, count, encoded);
+}
+
+void ZigZagEncode64Array(const int64* values, int count, uint64* encoded) {
+  GetKernels().zigzag_encode64_array(values, count, encoded);
+}
+
+int Varint32ArraySize(const uint32* values, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += CodedOutputStream::VarintSize32(values[i]);
+  }
+  return size;
+}
+
+int Varint32SignExtendedArraySize(const int32* values, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += CodedOutputStream::VarintSize32SignExtended(values[i]);
+  }
+  return size;
+}
+
+int Varint64ArraySize(const uint64* values, int count) {
+  int size = 0;
+  for (int i = 0; i < count; i++) {
+    size += CodedOutputStream::VarintSize64(values[i]);
+  }
+  return size;
+}
+
+// Narrowing is cheap enough that SSE2 is all the encoders use.
+
+uint8* WriteVarint32Array(const uint32* values, int count, uint8* target) {
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+  for (; count >= 16; values += 16, count -= 16) {
+    if (Narrow32(values, target)) {
+      target += 16;
+    } else {
+      for (int i = 0; i < 16; i++) {
+        target = CodedOutputStream::WriteVarint32ToArray(values[i], target);
+      }
+    }
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    target = CodedOutputStream::WriteVarint32ToArray(values[i], target);
+  }
+  return target;
+}
+
+uint8* WriteVarint32SignExtendedArray(const int32* values, int count,
+                                      uint8* target) {
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+  for (; count >= 16; values += 16, count -= 16) {
+    // negative values are never below 128 as uint32s
+    if (Narrow32(reinterpret_cast<const uint32*>(values), target)) {
+      target += 16;
+    } else {
+      for (int i = 0; i < 16; i++) {
+        target = CodedOutputStream::WriteVarint32SignExtendedToArray(
+            values[i], target);
+      }
+    }
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    target = CodedOutputStream::WriteVarint32SignExtendedToArray(values[i],
+                                                                 target);
+  }
+  return target;
+}
+
+uint8* WriteVarint64Array(const uint64* values, int count, uint8* target) {
+#ifdef GOOGLE_PROTOBUF_VARINT_ARRAY_SSE2
+  for (; count >= 16; values += 16, count -= 16) {
+    if (Narrow64(values, target)) {
+      target += 16;
+    } else {
+      for (int i = 0; i < 16; i++) {
+        target = CodedOutputStream::WriteVarint64ToArray(values[i], target);
+      }
+    }
+  }
+#endif
+  for (int i = 0; i < count; i++) {
+    target = CodedOutputStream::WriteVarint64ToArray(values[i], target);
+  }
+  return target;
+}
+
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
@@ -0,0 +1,102 @@
+// Protocol Buffers - Google's data interchange format
+// Copyright 2008 Google Inc.  All rights reserved.
+// http://code.google.com/p/protobuf/
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// This file contains bulk versions of the varint and ZigZag codecs of
+// CodedInputStream, CodedOutputStream and WireFormatLite, for whole runs
+// of packed repeated fields held in one contiguous buffer.
+//
+// Where the CPU allows, runs of single-byte varints -- common for small
+// counters and deltas -- are widened or narrowed with SSE2, or AVX2 when
+// it is detected at runtime, and the ZigZag transforms are vectorized the
+// same way.  Everything else goes through the usual scalar code, so the
+// results are always identical to decoding or encoding one value at a
+// time.
+
+#ifndef GOOGLE_PROTOBUF_IO_VARINT_ARRAY_H__
+#define GOOGLE_PROTOBUF_IO_VARINT_ARRAY_H__
+
+#include <google/protobuf/stubs/common.h>
+
+namespace google {
+namespace protobuf {
+namespace io {
+
+// Decoding ----------------------------------------------------------
+
+// Returns the number of varints that end within [begin, end), i.e. the
+// number of bytes without the continuation bit.  For a well-formed packed
+// run this is the number of values in it.
+LIBPROTOBUF_EXPORT int CountVarints(const uint8* begin, const uint8* end);
+
+// Decodes "count" consecutive varints starting at "begin" into "values".
+// Returns a pointer just past the last one, or NULL if the input is
+// malformed or a varint runs past "end".  As with
+// CodedInputStream::ReadVarint32(), varints of up to ten bytes are accepted
+// for 32-bit values (negative int32s are encoded that way) and truncated.
+LIBPROTOBUF_EXPORT const uint8* ReadVarint32Array(
+    const uint8* begin, const uint8* end, int count, uint32* values);
+LIBPROTOBUF_EXPORT const uint8* ReadVarint64Array(
+    const uint8* begin, const uint8* end, int count, uint64* values);
+
+// In place, from the ZigZag encoding of sint32/sint64 to two's complement.
+LIBPROTOBUF_EXPORT void ZigZagDecode32Array(uint32* values, int count);
+LIBPROTOBUF_EXPORT void ZigZagDecode64Array(uint64* values, int count);
+
+// Encoding ----------------------------------------------------------
+
+// The encoded size of "count" values.  Int32 values are sign-extended,
+// so negative ones take ten bytes.
+LIBPROTOBUF_EXPORT int Varint32ArraySize(const uint32* values, int count);
+LIBPROTOBUF_EXPORT int Varint32SignExtendedArraySize(const int32* values,
+                                                     int count);
+LIBPROTOBUF_EXPORT int Varint64ArraySize(const uint64* values, int count);
+
+// Write "count" values as consecutive varints and return a pointer past
+// the last byte written.  "target" must have room for the size computed
+// by the corresponding function above.
+LIBPROTOBUF_EXPORT uint8* WriteVarint32Array(
+    const uint32* values, int count, uint8* target);
+LIBPROTOBUF_EXPORT uint8* WriteVarint32SignExtendedArray(
+    const int32* values, int count, uint8* target);
+LIBPROTOBUF_EXPORT uint8* WriteVarint64Array(
+    const uint64* values, int count, uint8* target);
+
+// From "values" to their ZigZag encoding in "encoded", which may be the
+// same array.
+LIBPROTOBUF_EXPORT void ZigZagEncode32Array(const int32* values, int count,
+                                            uint32* encoded);
+LIBPROTOBUF_EXPORT void ZigZagEncode64Array(const int64* values, int count,
+                                            uint64* encoded);
+
+}  // namespace io
+}  // namespace protobuf
+
+}  // namespace google
+#endif  // GOOGLE_PROTOBUF_IO_VARINT_ARRAY_H__
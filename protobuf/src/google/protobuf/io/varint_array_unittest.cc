@@ -0,0 +1,219 @@
+// Protocol Buffers - Google's data interchange format
+// Copyright 2008 Google Inc.  All rights reserved.
+// http://code.google.com/p/protobuf/
+//
+// Redistribution and use in source and binary forms, with or without
+// modification, are permitted provided that the following conditions are
+// met:
+//
+//     * Redistributions of source code must retain the above copyright
+// notice, this list of conditions and the following disclaimer.
+//     * Redistributions in binary form must reproduce the above
+// copyright notice, this list of conditions and the following disclaimer
+// in the documentation and/or other materials provided with the
+// distribution.
+//     * Neither the name of Google Inc. nor the names of its
+// contributors may be used to endorse or promote products derived from
+// this software without specific prior written permission.
+//
+// THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+// "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+// LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+// A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+// OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+// SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+// LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+// DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+// THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+// (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+// OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+
+// The bulk codecs are checked against CodedInputStream, CodedOutputStream
+// and WireFormatLite, value for value.  The runs are long enough, and
+// mixed enough, to go through the vectorized paths and back out of them.
+
+#include <string>
+#include <vector>
+
+#include <google/protobuf/io/varint_array.h>
+
+#include <google/protobuf/stubs/common.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite_inl.h>
+#include <google/protobuf/testing/googletest.h>
+#include <gtest/gtest.h>
+
+namespace google {
+namespace protobuf {
+namespace io {
+namespace {
+
+using internal::WireFormatLite;
+
+// A mix of long single-byte runs and values of every length.
+vector<uint64> MakeValues(int count) {
+  vector<uint64> values;
+  uint64 state = 12345;
+  for (int i = 0; i < count; i++) {
+    state = state * GOOGLE_ULONGLONG(6364136223846793005) + 1;
+    if ((i / 40) % 2 == 0) {
+      values.push_back(state >> 57);
+    } else {
+      values.push_back(state >> (state >> 58));
+    }
+  }
+  return values;
+}
+
+template <typename T>
+string Encode(const vector<T>& values, bool sign_extended) {
+  string result;
+  {
+    StringOutputStream raw(&result);
+    CodedOutputStream output(&raw);
+    for (int i = 0; i < values.size(); i++) {
+      if (sign_extended) {
+        output.WriteVarint32SignExtended(static_cast<int32>(values[i]));
+      } else if (sizeof(T) == 4) {
+        output.WriteVarint32(static_cast<uint32>(values[i]));
+      } else {
+        output.WriteVarint64(static_cast<uint64>(values[i]));
+      }
+    }
+  }
+  return result;
+}
+
+const uint8* Begin(const string& data) {
+  return reinterpret_cast<const uint8*>(data.data());
+}
+
+const uint8* End(const string& data) {
+  return Begin(data) + data.size();
+}
+
+TEST(VarintArrayTest, CountVarints) {
+  const uint8 data[] = {0x01, 0x81, 0x01, 0xff, 0xff, 0x03, 0x80};
+  EXPECT_EQ(0, CountVarints(data, data));
+  EXPECT_EQ(3, CountVarints(data, data + 6));
+  EXPECT_EQ(3, CountVarints(data, data + 7));
+}
+
+TEST(VarintArrayTest, Read32) {
+  vector<uint64> wide = MakeValues(1000);
+  vector<uint32> values(wide.begin(), wide.end());
+  string data = Encode(values, false);
+
+  vector<uint32> decoded(values.size());
+  EXPECT_EQ(values.size(), CountVarints(Begin(data), End(data)));
+  EXPECT_EQ(End(data), ReadVarint32Array(Begin(data), End(data),
+                                         decoded.size(), &decoded[0]));
+  EXPECT_TRUE(values == decoded);
+}
+
+TEST(VarintArrayTest, Read64) {
+  vector<uint64> values = MakeValues(1000);
+  string data = Encode(values, false);
+
+  vector<uint64> decoded(values.size());
+  EXPECT_EQ(End(data), ReadVarint64Array(Begin(data), End(data),
+                                         decoded.size(), &decoded[0]));
+  EXPECT_TRUE(values == decoded);
+}
+
+TEST(VarintArrayTest, ReadNegativeInt32) {
+  // Ten-byte varints are truncated to their low 32 bits.
+  vector<int32> values;
+  for (int i = 0; i < 100; i++) values.push_back(i % 3 == 0 ? -i : i);
+  string data = Encode(values, true);
+
+  vector<uint32> decoded(values.size());
+  EXPECT_EQ(End(data), ReadVarint32Array(Begin(data), End(data),
+                                         decoded.size(), &decoded[0]));
+  for (int i = 0; i < values.size(); i++) {
+    EXPECT_EQ(values[i], static_cast<int32>(decoded[i]));
+  }
+}
+
+TEST(VarintArrayTest, ReadMalformed) {
+  vector<uint32> values(64, 1);
+  values.push_back(300);
+  string data = Encode(values, false);
+  vector<uint32> decoded(values.size());
+
+  // Truncated in the middle of the last varint.
+  EXPECT_TRUE(ReadVarint32Array(Begin(data), End(data) - 1,
+                                decoded.size(), &decoded[0]) == NULL);
+
+  // More than ten bytes.
+  string overlong(64, '\x01');
+  overlong.append(11, '\x80');
+  overlong.push_back('\x01');
+  EXPECT_TRUE(ReadVarint64Array(Begin(overlong), End(overlong), 65,
+                                reinterpret_cast<uint64*>(&decoded[0]))
+              == NULL);
+}
+
+TEST(VarintArrayTest, Write) {
+  vector<uint64> values = MakeValues(1000);
+  vector<uint32> values32(values.begin(), values.end());
+  vector<int32> signed32(values.begin(), values.end());
+
+  string expected = Encode(values, false);
+  string data(Varint64ArraySize(&values[0], values.size()), '\0');
+  EXPECT_EQ(expected.size(), data.size());
+  uint8* target = reinterpret_cast<uint8*>(&data[0]);
+  EXPECT_EQ(target + data.size(),
+            WriteVarint64Array(&values[0], values.size(), target));
+  EXPECT_EQ(expected, data);
+
+  expected = Encode(values32, false);
+  data.assign(Varint32ArraySize(&values32[0], values32.size()), '\0');
+  EXPECT_EQ(expected.size(), data.size());
+  target = reinterpret_cast<uint8*>(&data[0]);
+  EXPECT_EQ(target + data.size(),
+            WriteVarint32Array(&values32[0], values32.size(), target));
+  EXPECT_EQ(expected, data);
+
+  expected = Encode(signed32, true);
+  data.assign(Varint32SignExtendedArraySize(&signed32[0], signed32.size()),
+              '\0');
+  EXPECT_EQ(expected.size(), data.size());
+  target = reinterpret_cast<uint8*>(&data[0]);
+  EXPECT_EQ(target + data.size(),
+            WriteVarint32SignExtendedArray(&signed32[0], signed32.size(),
+                                           target));
+  EXPECT_EQ(expected, data);
+}
+
+TEST(VarintArrayTest, ZigZag) {
+  vector<uint64> values = MakeValues(1000);
+
+  vector<int32> signed32(values.begin(), values.end());
+  vector<uint32> encoded32(signed32.size());
+  ZigZagEncode32Array(&signed32[0], signed32.size(), &encoded32[0]);
+  for (int i = 0; i < signed32.size(); i++) {
+    EXPECT_EQ(WireFormatLite::ZigZagEncode32(signed32[i]), encoded32[i]);
+  }
+  ZigZagDecode32Array(&encoded32[0], encoded32.size());
+  for (int i = 0; i < signed32.size(); i++) {
+    EXPECT_EQ(signed32[i], static_cast<int32>(encoded32[i]));
+  }
+
+  vector<int64> signed64(values.begin(), values.end());
+  vector<uint64> encoded64(signed64.size());
+  ZigZagEncode64Array(&signed64[0], signed64.size(), &encoded64[0]);
+  for (int i = 0; i < signed64.size(); i++) {
+    EXPECT_EQ(WireFormatLite::ZigZagEncode64(signed64[i]), encoded64[i]);
+  }
+  ZigZagDecode64Array(&encoded64[0], encoded64.size());
+  for (int i = 0; i < signed64.size(); i++) {
+    EXPECT_EQ(signed64[i], static_cast<int64>(encoded64[i]));
+  }
+}
+
+}  // namespace
+}  // namespace io
+}  // namespace protobuf
+}  // namespace google
@@ -184,6 +184,16 @@ bool Message::SerializePartialToOstream(ostream* output) const {
 
 Reflection::~Reflection() {}
 
+const void* Reflection::GetRawRepeatedPrimitive(
+    const Message& message, const FieldDescriptor* field) const {
+  return NULL;
+}
+
+void* Reflection::MutableRawRepeatedPrimitive(
+    Message* message, const FieldDescriptor* field) const {
+  return NULL;
+}
+
 // ===================================================================
 // MessageFactory
 
@@ -619,6 +619,19 @@ class LIBPROTOBUF_EXPORT Reflection {
   virtual const FieldDescriptor* FindKnownExtensionByNumber(
       int number) const = 0;
 
+  // Bulk access -----------------------------------------------------
+
+  // For a repeated field of a primitive (numeric, bool or enum) type,
+  // returns the RepeatedField<T> that stores it, where T is the field's
+  // C++ type (int for enums), so that whole runs of values can be read or
+  // written at once.  Returns NULL if the implementation doesn't store the
+  // field that way; callers must then fall back to the accessors above.
+  // The default implementation always returns NULL.
+  virtual const void* GetRawRepeatedPrimitive(
+      const Message& message, const FieldDescriptor* field) const;
+  virtual void* MutableRawRepeatedPrimitive(
+      Message* message, const FieldDescriptor* field) const;
+
  private:
   GOOGLE_DISALLOW_EVIL_CONSTRUCTORS(Reflection);
 };
@@ -104,6 +104,9 @@ class RepeatedField {
 
   void AddAlreadyReserved(const Element& value);
   Element* AddAlreadyReserved();
+  // Like AddAlreadyReserved(), but adds "n" elements at once and returns a
+  // pointer to the first of them.  Their values are unspecified until set.
+  Element* AddNAlreadyReserved(int n);
   int Capacity() const;
 
   // Gets the underlying array.  This pointer is possibly invalidated by
@@ -469,6 +472,14 @@ inline Element* RepeatedField<Element>::AddAlreadyReserved() {
   return &elements_[current_size_++];
 }
 
+template<typename Element>
+inline Element* RepeatedField<Element>::AddNAlreadyReserved(int n) {
+  GOOGLE_DCHECK_LE(size() + n, Capacity());
+  Element* result = elements_ + current_size_;
+  current_size_ += n;
+  return result;
+}
+
 template <typename Element>
 inline const Element& RepeatedField<Element>::Get(int index) const {
   GOOGLE_DCHECK_LT(index, size());
@@ -32,6 +32,7 @@
 //  Based on original Protocol Buffers design by
 //  Sanjay Ghemawat, Jeff Dean, and others.
 
+#include <algorithm>
 #include <stack>
 #include <string>
 #include <vector>
@@ -43,8 +44,10 @@
 #include <google/protobuf/wire_format_lite_inl.h>
 #include <google/protobuf/descriptor.pb.h>
 #include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/varint_array.h>
 #include <google/protobuf/io/zero_copy_stream.h>
 #include <google/protobuf/io/zero_copy_stream_impl.h>
+#include <google/protobuf/repeated_field.h>
 #include <google/protobuf/unknown_field_set.h>
 
 
@@ -61,6 +64,317 @@ inline int GetEnumNumber(const EnumValueDescriptor* descriptor) {
   return descriptor->number();
 }
 
+// Packed fields in bulk ---------------------------------------------
+//
+// When the reflection exposes the RepeatedField behind a packed field,
+// whole runs of varints are decoded and encoded with the array codecs in
+// io/varint_array.h instead of one value, and one virtual call, at a time.
+// On little-endian hosts fixed-width values are on the wire as they are in
+// memory, so their runs are simply copied.
+
+inline bool IsBulkVarintType(FieldDescriptor::Type type) {
+  switch (type) {
+    case FieldDescriptor::TYPE_INT32:
+    case FieldDescriptor::TYPE_INT64:
+    case FieldDescriptor::TYPE_SINT32:
+    case FieldDescriptor::TYPE_SINT64:
+    case FieldDescriptor::TYPE_UINT32:
+    case FieldDescriptor::TYPE_UINT64:
+      return true;
+    default:
+      return false;
+  }
+}
+
+inline bool IsBulkFixedType(FieldDescriptor::Type type) {
+#if defined(PROTOBUF_LITTLE_ENDIAN)
+  switch (type) {
+    case FieldDescriptor::TYPE_FIXED32:
+    case FieldDescriptor::TYPE_FIXED64:
+    case FieldDescriptor::TYPE_SFIXED32:
+    case FieldDescriptor::TYPE_SFIXED64:
+    case FieldDescriptor::TYPE_FLOAT:
+    case FieldDescriptor::TYPE_DOUBLE:
+      return true;
+    default:
+      return false;
+  }
+#else
+  return false;
+#endif
+}
+
+inline bool IsBulkType(FieldDescriptor::Type type) {
+  return IsBulkVarintType(type) || IsBulkFixedType(type);
+}
+
+inline const uint8* ReadVarintArray(const uint8* begin, const uint8* end,
+                                    int count, uint32* values) {
+  return io::ReadVarint32Array(begin, end, count, values);
+}
+inline const uint8* ReadVarintArray(const uint8* begin, const uint8* end,
+                                    int count, uint64* values) {
+  return io::ReadVarint64Array(begin, end, count, values);
+}
+inline void ZigZagDecodeArray(uint32* values, int count) {
+  io::ZigZagDecode32Array(values, count);
+}
+inline void ZigZagDecodeArray(uint64* values, int count) {
+  io::ZigZagDecode64Array(values, count);
+}
+
+// Appends the packed run [begin, end) to "field", whose elements are
+// decoded as the unsigned type UType of the same size.  Returns false,
+// leaving the field as it was, if the run is malformed.
+template <typename CType, typename UType>
+bool ReadPackedVarints(const uint8* begin, const uint8* end, bool zigzag,
+                       RepeatedField<CType>* field) {
+  const int count = io::CountVarints(begin, end);
+  const int old_size = field->size();
+  field->Reserve(old_size + count);
+  UType* values = reinterpret_cast<UType*>(field->AddNAlreadyReserved(count));
+  if (ReadVarintArray(begin, end, count, values) != end) {
+    field->Truncate(old_size);
+    return false;
+  }
+  if (zigzag) ZigZagDecodeArray(values, count);
+  return true;
+}
+
+// Appends the packed run of "length" bytes at "begin" to "field".  Returns
+// false if it isn't a whole number of values.
+template <typename CType>
+bool ReadPackedFixed(const uint8* begin, int length,
+                     RepeatedField<CType>* field) {
+  if (length % sizeof(CType) != 0) return false;
+  const int count = length / sizeof(CType);
+  field->Reserve(field->size() + count);
+  memcpy(field->AddNAlreadyReserved(count), begin, length);
+  return true;
+}
+
+// Reads the packed field of "length" bytes at the current position of
+// "input" in one go, if its type and storage allow it and the bytes are all
+// in the current buffer.  Returns false if it didn't; otherwise "*ok" tells
+// whether the data was well-formed.
+bool ReadPackedInBulk(io::CodedInputStream* input, int length,
+                      const FieldDescriptor* field,
+                      const Reflection* reflection, Message* message,
+                      bool* ok) {
+  if (!IsBulkType(field->type())) return false;
+
+  const void* data;
+  int available;
+  if (length <= 0 || !input->GetDirectBufferPointer(&data, &available) ||
+      available < length) {
+    return false;
+  }
+  void* raw = reflection->MutableRawRepeatedPrimitive(message, field);
+  if (raw == NULL) return false;
+
+  const uint8* begin = static_cast<const uint8*>(data);
+  const uint8* end = begin + length;
+  switch (field->type()) {
+#define HANDLE_TYPE(TYPE, CPPTYPE, UTYPE, ZIGZAG)                          \
+    case FieldDescriptor::TYPE_##TYPE:                                     \
+      *ok = ReadPackedVarints<CPPTYPE, UTYPE>(                             \
+          begin, end, ZIGZAG, static_cast<RepeatedField<CPPTYPE>*>(raw));  \
+      break;
+
+    HANDLE_TYPE( INT32,  int32, uint32, false)
+    HANDLE_TYPE( INT64,  int64, uint64, false)
+    HANDLE_TYPE(SINT32,  int32, uint32, true )
+    HANDLE_TYPE(SINT64,  int64, uint64, true )
+    HANDLE_TYPE(UINT32, uint32, uint32, false)
+    HANDLE_TYPE(UINT64, uint64, uint64, false)
+#undef HANDLE_TYPE
+
+#define HANDLE_TYPE(TYPE, CPPTYPE)                                         \
+    case FieldDescriptor::TYPE_##TYPE:                                     \
+      *ok = ReadPackedFixed<CPPTYPE>(                                      \
+          begin, length, static_cast<RepeatedField<CPPTYPE>*>(raw));       \
+      break;
+
+    HANDLE_TYPE( FIXED32, uint32)
+    HANDLE_TYPE( FIXED64, uint64)
+    HANDLE_TYPE(SFIXED32,  int32)
+    HANDLE_TYPE(SFIXED64,  int64)
+    HANDLE_TYPE(FLOAT   ,  float)
+    HANDLE_TYPE(DOUBLE  , double)
+#undef HANDLE_TYPE
+
+    default:
+      return false;
+  }
+  if (*ok) *ok = input->Skip(length);
+  return true;
+}
+
+// ZigZag-encoded fields are sized and written a chunk of this many values
+// at a time, encoded into a buffer on the stack.
+const int kZigZagChunkSize = 256;
+
+inline void ZigZagEncodeArray(const int32* values, int count, uint32* out) {
+  io::ZigZagEncode32Array(values, count, out);
+}
+inline void ZigZagEncodeArray(const int64* values, int count, uint64* out) {
+  io::ZigZagEncode64Array(values, count, out);
+}
+inline int VarintArraySize(const uint32* values, int count) {
+  return io::Varint32ArraySize(values, count);
+}
+inline int VarintArraySize(const uint64* values, int count) {
+  return io::Varint64ArraySize(values, count);
+}
+inline uint8* WriteVarintArray(const uint32* values, int count,
+                               uint8* target) {
+  return io::WriteVarint32Array(values, count, target);
+}
+inline uint8* WriteVarintArray(const uint64* values, int count,
+                               uint8* target) {
+  return io::WriteVarint64Array(values, count, target);
+}
+
+// The encoded size of the sint32 or sint64 field stored in "raw", whose
+// ZigZag values have the unsigned type UType.
+template <typename SType, typename UType>
+int ZigZagVarintsSize(const void* raw) {
+  const RepeatedField<SType>& values =
+      *static_cast<const RepeatedField<SType>*>(raw);
+  UType chunk[kZigZagChunkSize];
+  int size = 0;
+  for (int i = 0; i < values.size(); i += kZigZagChunkSize) {
+    const int count = min(kZigZagChunkSize, values.size() - i);
+    ZigZagEncodeArray(values.data() + i, count, chunk);
+    size += VarintArraySize(chunk, count);
+  }
+  return size;
+}
+
+// Encodes the sint32 or sint64 field stored in "raw" at "target".
+template <typename SType, typename UType>
+uint8* WriteZigZagVarintsToArray(const void* raw, uint8* target) {
+  const RepeatedField<SType>& values =
+      *static_cast<const RepeatedField<SType>*>(raw);
+  UType chunk[kZigZagChunkSize];
+  for (int i = 0; i < values.size(); i += kZigZagChunkSize) {
+    const int count = min(kZigZagChunkSize, values.size() - i);
+    ZigZagEncodeArray(values.data() + i, count, chunk);
+    target = WriteVarintArray(chunk, count, target);
+  }
+  return target;
+}
+
+// The encoded size of the packed varint field stored in "raw".
+int PackedVarintsSize(FieldDescriptor::Type type, const void* raw) {
+  switch (type) {
+    case FieldDescriptor::TYPE_INT32: {
+      const RepeatedField<int32>& values =
+          *static_cast<const RepeatedField<int32>*>(raw);
+      return io::Varint32SignExtendedArraySize(values.data(), values.size());
+    }
+    case FieldDescriptor::TYPE_UINT32: {
+      const RepeatedField<uint32>& values =
+          *static_cast<const RepeatedField<uint32>*>(raw);
+      return io::Varint32ArraySize(values.data(), values.size());
+    }
+    case FieldDescriptor::TYPE_INT64: {
+      const RepeatedField<int64>& values =
+          *static_cast<const RepeatedField<int64>*>(raw);
+      return io::Varint64ArraySize(
+          reinterpret_cast<const uint64*>(values.data()), values.size());
+    }
+    case FieldDescriptor::TYPE_UINT64: {
+      const RepeatedField<uint64>& values =
+          *static_cast<const RepeatedField<uint64>*>(raw);
+      return io::Varint64ArraySize(values.data(), values.size());
+    }
+    case FieldDescriptor::TYPE_SINT32:
+      return ZigZagVarintsSize<int32, uint32>(raw);
+    case FieldDescriptor::TYPE_SINT64:
+      return ZigZagVarintsSize<int64, uint64>(raw);
+    default:
+      GOOGLE_LOG(FATAL) << "Not a bulk varint type: " << type;
+      return 0;
+  }
+}
+
+// Encodes the packed varint field stored in "raw" at "target", which must
+// have room for its FieldDataOnlyByteSize().
+uint8* WritePackedVarintsToArray(FieldDescriptor::Type type, const void* raw,
+                                 uint8* target) {
+  switch (type) {
+    case FieldDescriptor::TYPE_INT32: {
+      const RepeatedField<int32>& values =
+          *static_cast<const RepeatedField<int32>*>(raw);
+      return io::WriteVarint32SignExtendedArray(
+          values.data(), values.size(), target);
+    }
+    case FieldDescriptor::TYPE_UINT32: {
+      const RepeatedField<uint32>& values =
+          *static_cast<const RepeatedField<uint32>*>(raw);
+      return io::WriteVarint32Array(values.data(), values.size(), target);
+    }
+    case FieldDescriptor::TYPE_INT64: {
+      const RepeatedField<int64>& values =
+          *static_cast<const RepeatedField<int64>*>(raw);
+      return io::WriteVarint64Array(
+          reinterpret_cast<const uint64*>(values.data()), values.size(),
+          target);
+    }
+    case FieldDescriptor::TYPE_UINT64: {
+      const RepeatedField<uint64>& values =
+          *static_cast<const RepeatedField<uint64>*>(raw);
+      return io::WriteVarint64Array(values.data(), values.size(), target);
+    }
+    case FieldDescriptor::TYPE_SINT32:
+      return WriteZigZagVarintsToArray<int32, uint32>(raw, target);
+    case FieldDescriptor::TYPE_SINT64:
+      return WriteZigZagVarintsToArray<int64, uint64>(raw, target);
+    default:
+      GOOGLE_LOG(FATAL) << "Not a bulk varint type: " << type;
+      return target;
+  }
+}
+
+// The elements of the fixed-width field stored in "raw".
+const void* PackedFixedData(FieldDescriptor::Type type, const void* raw) {
+  switch (type) {
+#define HANDLE_TYPE(TYPE, CPPTYPE)                                         \
+    case FieldDescriptor::TYPE_##TYPE:                                     \
+      return static_cast<const RepeatedField<CPPTYPE>*>(raw)->data();
+
+    HANDLE_TYPE( FIXED32, uint32)
+    HANDLE_TYPE( FIXED64, uint64)
+    HANDLE_TYPE(SFIXED32,  int32)
+    HANDLE_TYPE(SFIXED64,  int64)
+    HANDLE_TYPE(FLOAT   ,  float)
+    HANDLE_TYPE(DOUBLE  , double)
+#undef HANDLE_TYPE
+
+    default:
+      GOOGLE_LOG(FATAL) << "Not a bulk fixed-width type: " << type;
+      return NULL;
+  }
+}
+
+// Writes the "data_size" bytes of the packed field stored in "raw".
+void WritePackedInBulk(FieldDescriptor::Type type, const void* raw,
+                       int data_size, io::CodedOutputStream* output) {
+  if (IsBulkFixedType(type)) {
+    output->WriteRaw(PackedFixedData(type, raw), data_size);
+    return;
+  }
+  uint8* target = output->GetDirectBufferForNBytesAndAdvance(data_size);
+  if (target != NULL) {
+    WritePackedVarintsToArray(type, raw, target);
+  } else {
+    string buffer(data_size, '\0');
+    WritePackedVarintsToArray(type, raw, reinterpret_cast<uint8*>(&buffer[0]));
+    output->WriteString(buffer);
+  }
+}
+
 }  // anonymous namespace
 
 // ===================================================================
@@ -449,6 +763,14 @@ bool WireFormat::ParseAndMergeField(
     if (!input->ReadVarint32(&length)) return false;
     io::CodedInputStream::Limit limit = input->PushLimit(length);
 
+    bool ok;
+    if (ReadPackedInBulk(input, length, field, message_reflection, message,
+                         &ok)) {
+      if (!ok) return false;
+      input->PopLimit(limit);
+      return true;
+    }
+
     switch (field->type()) {
 #define HANDLE_PACKED_TYPE(TYPE, CPPTYPE, CPPTYPE_METHOD)                      \
       case FieldDescriptor::TYPE_##TYPE: {                                     \
@@ -762,6 +1084,13 @@ void WireFormat::SerializeFieldWithCachedSizes(
         WireFormatLite::WIRETYPE_LENGTH_DELIMITED, output);
     const int data_size = FieldDataOnlyByteSize(field, message);
     output->WriteVarint32(data_size);
+
+    const void* raw = IsBulkType(field->type()) ?
+        message_reflection->GetRawRepeatedPrimitive(message, field) : NULL;
+    if (raw != NULL) {
+      WritePackedInBulk(field->type(), raw, data_size, output);
+      return;
+    }
   }
 
   for (int j = 0; j < count; j++) {
@@ -948,6 +1277,12 @@ int WireFormat::FieldDataOnlyByteSize(
     count = 1;
   }
 
+  if (count > 0 && field->is_repeated() && IsBulkVarintType(field->type())) {
+    const void* raw =
+        message_reflection->GetRawRepeatedPrimitive(message, field);
+    if (raw != NULL) return PackedVarintsSize(field->type(), raw);
+  }
+
   int data_size = 0;
   switch (field->type()) {
 #define HANDLE_TYPE(TYPE, TYPE_METHOD, CPPTYPE_METHOD)                     \
@@ -158,6 +158,148 @@ TEST(WireFormatTest, ParseUnpackedFromPacked) {
   TestUtil::ExpectUnpackedFieldsSet(dest);
 }
 
+// Long packed runs of every varint type, mixing runs of one-byte values
+// with values of every length, parsed as one buffer and in chunks that
+// split them.
+TEST(WireFormatTest, ParsePackedVarintsInBulk) {
+  unittest::TestPackedTypes source;
+  uint64 state = 12345;
+  for (int i = 0; i < 1000; i++) {
+    state = state * GOOGLE_ULONGLONG(6364136223846793005) + 1;
+    uint64 value = (i / 40) % 2 == 0 ? state >> 58 : state >> (state >> 58);
+    int64 sign = i % 3 == 0 ? -1 : 1;
+    source.add_packed_int32(sign * static_cast<int32>(value));
+    source.add_packed_int64(sign * static_cast<int64>(value));
+    source.add_packed_sint32(sign * static_cast<int32>(value));
+    source.add_packed_sint64(sign * static_cast<int64>(value));
+    source.add_packed_uint32(static_cast<uint32>(value));
+    source.add_packed_uint64(value);
+  }
+  string data = source.SerializeAsString();
+
+  const int kBlockSizes[] = {-1, 1, 7, 64, 1000};
+  for (int i = 0; i < GOOGLE_ARRAYSIZE(kBlockSizes); i++) {
+    SCOPED_TRACE(kBlockSizes[i]);
+    unittest::TestPackedTypes dest;
+    io::ArrayInputStream raw_input(data.data(), data.size(), kBlockSizes[i]);
+    io::CodedInputStream input(&raw_input);
+    ASSERT_TRUE(WireFormat::ParseAndMergePartial(&input, &dest));
+    EXPECT_TRUE(input.ConsumedEntireMessage());
+    EXPECT_EQ(source.DebugString(), dest.DebugString());
+
+    // Serialize using WireFormat.
+    string dynamic_data;
+    {
+      int size = dest.ByteSize();
+      EXPECT_EQ(size, WireFormat::ByteSize(dest));
+      io::StringOutputStream raw_output(&dynamic_data);
+      io::CodedOutputStream output(&raw_output);
+      WireFormat::SerializeWithCachedSizes(dest, size, &output);
+      ASSERT_FALSE(output.HadError());
+    }
+    EXPECT_TRUE(dynamic_data == data);
+  }
+}
+
+// A packed varint run whose last value is cut off fails the parse and
+// leaves the field as it was.
+TEST(WireFormatTest, ParsePackedVarintsMalformed) {
+  const FieldDescriptor* field =
+    unittest::TestPackedTypes::descriptor()->FindFieldByName("packed_int32");
+  ASSERT_TRUE(field != NULL);
+
+  string run(99, '\x01');
+  run.push_back('\x80');
+  string data;
+  {
+    io::StringOutputStream raw_output(&data);
+    io::CodedOutputStream output(&raw_output);
+    WireFormatLite::WriteBytes(field->number(), run, &output);
+  }
+
+  unittest::TestPackedTypes dest;
+  dest.add_packed_int32(5);
+  dest.add_packed_int32(6);
+  io::ArrayInputStream raw_input(data.data(), data.size());
+  io::CodedInputStream input(&raw_input);
+  EXPECT_FALSE(WireFormat::ParseAndMergePartial(&input, &dest));
+  ASSERT_EQ(2, dest.packed_int32_size());
+  EXPECT_EQ(5, dest.packed_int32(0));
+  EXPECT_EQ(6, dest.packed_int32(1));
+
+  // split across buffers, the run is read one value at a time
+  io::ArrayInputStream chunked_input(data.data(), data.size(), 7);
+  io::CodedInputStream chunked(&chunked_input);
+  EXPECT_FALSE(WireFormat::ParseAndMergePartial(&chunked, &dest));
+}
+
+// Long packed runs of every fixed-width type, parsed as one buffer and
+// in chunks that split them.
+TEST(WireFormatTest, ParsePackedFixedInBulk) {
+  unittest::TestPackedTypes source;
+  for (int i = 0; i < 1000; i++) {
+    source.add_packed_fixed32(i * 2654435761u);
+    source.add_packed_fixed64(i * GOOGLE_ULONGLONG(0x9E3779B97F4A7C15));
+    source.add_packed_sfixed32(i % 2 ? -i : i);
+    source.add_packed_sfixed64(i % 2 ? -i : i);
+    source.add_packed_float(i / 3.0f);
+    source.add_packed_double(-i / 7.0);
+  }
+  string data = source.SerializeAsString();
+
+  const int kBlockSizes[] = {-1, 1, 7, 64, 1000};
+  for (int i = 0; i < GOOGLE_ARRAYSIZE(kBlockSizes); i++) {
+    SCOPED_TRACE(kBlockSizes[i]);
+    unittest::TestPackedTypes dest;
+    io::ArrayInputStream raw_input(data.data(), data.size(), kBlockSizes[i]);
+    io::CodedInputStream input(&raw_input);
+    ASSERT_TRUE(WireFormat::ParseAndMergePartial(&input, &dest));
+    EXPECT_TRUE(input.ConsumedEntireMessage());
+    EXPECT_EQ(source.DebugString(), dest.DebugString());
+
+    // Serialize using WireFormat.
+    string dynamic_data;
+    {
+      int size = dest.ByteSize();
+      io::StringOutputStream raw_output(&dynamic_data);
+      io::CodedOutputStream output(&raw_output);
+      WireFormat::SerializeWithCachedSizes(dest, size, &output);
+      ASSERT_FALSE(output.HadError());
+    }
+    EXPECT_TRUE(dynamic_data == data);
+  }
+}
+
+// A packed fixed-width run whose length isn't a multiple of the element
+// size is malformed, whether or not it is read in one go.
+TEST(WireFormatTest, ParsePackedFixedBadLength) {
+  const char* kFields[] = {"packed_fixed32", "packed_sfixed64",
+                           "packed_float", "packed_double"};
+  for (int i = 0; i < GOOGLE_ARRAYSIZE(kFields); i++) {
+    const FieldDescriptor* field =
+      unittest::TestPackedTypes::descriptor()->FindFieldByName(kFields[i]);
+    ASSERT_TRUE(field != NULL);
+    SCOPED_TRACE(kFields[i]);
+
+    string data;
+    {
+      io::StringOutputStream raw_output(&data);
+      io::CodedOutputStream output(&raw_output);
+      WireFormatLite::WriteBytes(field->number(), string(12 + 2, '\x01'),
+                                 &output);
+    }
+
+    const int kBlockSizes[] = {-1, 3};
+    for (int j = 0; j < GOOGLE_ARRAYSIZE(kBlockSizes); j++) {
+      SCOPED_TRACE(kBlockSizes[j]);
+      unittest::TestPackedTypes dest;
+      io::ArrayInputStream raw_input(data.data(), data.size(), kBlockSizes[j]);
+      io::CodedInputStream input(&raw_input);
+      EXPECT_FALSE(WireFormat::ParseAndMergePartial(&input, &dest));
+    }
+  }
+}
+
 TEST(WireFormatTest, ParsePackedExtensions) {
   unittest::TestPackedExtensions source, dest;
   string data;
@@ -33,6 +33,7 @@ copy ..\src\google\protobuf\io\coded_stream.h include\google\protobuf\io\coded_s
 copy ..\src\google\protobuf\io\gzip_stream.h include\google\protobuf\io\gzip_stream.h
 copy ..\src\google\protobuf\io\printer.h include\google\protobuf\io\printer.h
 copy ..\src\google\protobuf\io\tokenizer.h include\google\protobuf\io\tokenizer.h
+copy ..\src\google\protobuf\io\varint_array.h include\google\protobuf\io\varint_array.h
 copy ..\src\google\protobuf\io\zero_copy_stream.h include\google\protobuf\io\zero_copy_stream.h
 copy ..\src\google\protobuf\io\zero_copy_stream_impl.h include\google\protobuf\io\zero_copy_stream_impl.h
 copy ..\src\google\protobuf\io\zero_copy_stream_impl_lite.h include\google\protobuf\io\zero_copy_stream_impl_lite.h
@@ -12,7 +12,24 @@
 // implied. See the License for the specific language governing
 // permissions and limitations under the License.
 
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+#include <algorithm>
+#include <climits>
 #include <map>
+#include <set>
 #include <string>
 #include <vector>
 #include <iostream>
@@ -24,20 +41,65 @@
 #include <google/protobuf/dynamic_message.h>
 #include <google/protobuf/descriptor.h>
 #include <google/protobuf/descriptor.pb.h>
+#include <google/protobuf/descriptor_database.h>
+#include <google/protobuf/repeated_field.h>
+#include <google/protobuf/stubs/hash.h>
+#include <google/protobuf/stubs/strutil.h>
 #include <google/protobuf/service.h>
+#include <google/protobuf/compiler/importer.h>
+#include <google/protobuf/io/coded_stream.h>
+#include <google/protobuf/io/varint_array.h>
+#include <google/protobuf/io/zero_copy_stream_impl_lite.h>
+#include <google/protobuf/wire_format_lite.h>
+#include <google/protobuf/wire_format_lite_inl.h>
 
 #include "protobuf_for_node.h"
 
+// BigInt is part of the V8 API from 6.8 (node 10) on.
+#if V8_MAJOR_VERSION > 6 || (V8_MAJOR_VERSION == 6 && V8_MINOR_VERSION >= 8)
+#define PROTOBUF_FOR_NODE_BIGINT 1
+#else
+#define PROTOBUF_FOR_NODE_BIGINT 0
+#endif
+
 using google::protobuf::Descriptor;
 using google::protobuf::DescriptorPool;
+using google::protobuf::EncodedDescriptorDatabase;
+using google::protobuf::DynamicMessageArena;
 using google::protobuf::DynamicMessageFactory;
+using google::protobuf::EnumDescriptor;
+using google::protobuf::EnumValueDescriptor;
 using google::protobuf::FieldDescriptor;
+using google::protobuf::FileDescriptor;
+using google::protobuf::FileDescriptorProto;
 using google::protobuf::FileDescriptorSet;
 using google::protobuf::Message;
 using google::protobuf::MethodDescriptor;
 using google::protobuf::Reflection;
+using google::protobuf::RepeatedField;
 using google::protobuf::Service;
 using google::protobuf::ServiceDescriptor;
+using google::protobuf::int32;
+using google::protobuf::int64;
+using google::protobuf::uint32;
+using google::protobuf::uint64;
+using google::protobuf::uint8;
+using google::protobuf::hash_map;
+using google::protobuf::kFastToBufferSize;
+using google::protobuf::SimpleItoa;
+using google::protobuf::compiler::DiskSourceTree;
+using google::protobuf::compiler::Importer;
+using google::protobuf::compiler::MultiFileErrorCollector;
+using google::protobuf::compiler::SourceTree;
+using google::protobuf::io::ArrayInputStream;
+using google::protobuf::io::StringOutputStream;
+using google::protobuf::io::CodedInputStream;
+using google::protobuf::io::CodedOutputStream;
+using google::protobuf::io::CountVarints;
+using google::protobuf::io::ReadVarint32Array;
+using google::protobuf::io::ZigZagDecode32Array;
+using google::protobuf::io::ZeroCopyInputStream;
+using google::protobuf::internal::WireFormatLite;
 
 using Nan::ObjectWrap;
 
@@ -68,6 +130,16 @@ namespace protobuf_for_node {
   const char E_NO_ARRAY[] = "Not an array";
   const char E_NO_OBJECT[] = "Not an object";
   const char E_UNKNOWN_ENUM[] = "Unknown enum value";
+  const char E_CHANGED[] = "Object changed during serialization";
+  const char E_TOO_LARGE[] = "Message too large";
+  const char E_ENUM_MODE[] = "enums should be 'string' or 'number'";
+  const char E_FIELDS[] = "fields should be an array of known field paths or a mask of the type";
+  // starts with a zero tag, so it can't be mistaken for a descriptor set
+  const char kSnapshotMagic[] = "\0PBSNAP1";
+  const int kSnapshotMagicSize = 8;
+
+  const char E_PROTO_FILES[] = "Argument should be a file name, an array of them or an object of sources";
+  const char E_INT64_MODE[] = "int64 should be one of 'string', 'number' or 'bigint' (where supported)";
 
   Nan::Persistent<FunctionTemplate> SchemaTemplate;
   Nan::Persistent<FunctionTemplate> ServiceSchemaTemplate;
@@ -76,49 +148,388 @@ namespace protobuf_for_node {
   Nan::Persistent<FunctionTemplate> TypeTemplate;
   Nan::Persistent<FunctionTemplate> ParseTemplate;
   Nan::Persistent<FunctionTemplate> SerializeTemplate;
+  Nan::Persistent<FunctionTemplate> ParseAsyncTemplate;
+  Nan::Persistent<FunctionTemplate> SerializeAsyncTemplate;
+  Nan::Persistent<FunctionTemplate> ParseManyTemplate;
+  Nan::Persistent<FunctionTemplate> ParseDelimitedTemplate;
+  Nan::Persistent<FunctionTemplate> SerializeDelimitedTemplate;
+  Nan::Persistent<FunctionTemplate> NewDecoderTemplate;
+  Nan::Persistent<FunctionTemplate> DecoderTemplate;
+  Nan::Persistent<FunctionTemplate> NewMaskTemplate;
+  Nan::Persistent<FunctionTemplate> MaskTemplate;
+  Nan::Persistent<FunctionTemplate> PoolStatsTemplate;
+  Nan::Persistent<FunctionTemplate> PeekTemplate;
+  Nan::Persistent<FunctionTemplate> SerializeIntoTemplate;
+  Nan::Persistent<FunctionTemplate> ByteSizeTemplate;
+  Nan::Persistent<FunctionTemplate> SerializeVTemplate;
+  Nan::Persistent<FunctionTemplate> FromProtoTemplate;
+  // JS side of lazy parses: {raw: key, define: function(...)}
+  Nan::Persistent<Object> LazyHelper;
 
   class Schema : public Nan::ObjectWrap {
   public:
+    static const size_t kDefaultPoolSize = 16;
+
+    // Options of the parse methods.  Those given to the Schema are the
+    // defaults for every call.
+    enum Int64Mode {
+      INT64_STRING,  // decimal strings
+      INT64_NUMBER,  // Numbers where exact, strings otherwise
+      INT64_BIGINT
+    };
+
+    // Compiled from the "fields" parse option: the fields to decode, by
+    // descriptor index, and for sub-messages which of their own fields
+    // (NULL for all).  Everything else is skipped on the wire.
+    struct FieldMask {
+      vector<bool> include;
+      vector<FieldMask*> children;
+
+      explicit FieldMask(int field_count)
+        : include(field_count, false), children(field_count, NULL) {}
+
+      ~FieldMask() {
+        for (size_t i = 0; i < children.size(); i++) delete children[i];
+      }
+    };
+
+    struct ParseOptions {
+      bool zero_copy;  // bytes fields as slices of the input Buffer
+      Int64Mode int64;
+      bool enum_numbers;  // enums as numbers rather than names
+      bool dense;  // every field present, unset ones as undefined
+      bool lazy;  // sub-messages decoded on first access
+      bool typed_arrays;  // repeated 32-bit and floating point fields as TypedArrays
+      const FieldMask* mask;  // per call only; owned by the Type or a Mask
+
+      ParseOptions()
+        : zero_copy(false), int64(INT64_STRING), enum_numbers(false), dense(false),
+          lazy(false), typed_arrays(false), mask(NULL) {}
+    };
+
+    // Shared by all fields of an enum type: the value names, created once
+    // as internalized strings, in descriptor order.
+    struct EnumTable {
+      const EnumDescriptor* descriptor;
+      Nan::Persistent<String>* names;
+
+      explicit EnumTable(const EnumDescriptor* descriptor)
+        : descriptor(descriptor),
+          names(new Nan::Persistent<String>[descriptor->value_count()]) {
+        for (int i = 0; i < descriptor->value_count(); i++) {
+          names[i].Reset(String::NewFromUtf8(v8::Isolate::GetCurrent(),
+                                             descriptor->value(i)->name().c_str(),
+                                             String::kInternalizedString));
+        }
+      }
+
+      ~EnumTable() {
+        for (int i = 0; i < descriptor->value_count(); i++) names[i].Reset();
+        delete[] names;
+      }
+
+      Local<String> Name(const EnumValueDescriptor* value) const {
+        return Nan::New(names[value->index()]);
+      }
+
+      // The value with the given number or name, or NULL.
+      const EnumValueDescriptor* Find(Local<Value> value) const {
+        // Scanning small enums by identity is cheap, and catches the
+        // names we handed out as well as string literals, which are
+        // internalized too.
+        static const int kMaxIdentityScan = 16;
+
+        if (value->IsNumber()) {
+          return descriptor->FindValueByNumber(value->Int32Value());
+        }
+        if (descriptor->value_count() <= kMaxIdentityScan) {
+          for (int i = 0; i < descriptor->value_count(); i++) {
+            if (value == Nan::New(names[i])) return descriptor->value(i);
+          }
+        }
+        return descriptor->FindValueByName(Type::CString(value->ToString()).data());
+      }
+    };
+
     Schema(Local<Object> self, const DescriptorPool* pool)
-        : pool_(pool) {
+        : pool_(pool), database_(NULL), pool_size_(kDefaultPoolSize), arena_(NULL),
+          arena_scratch_(0) {
       factory_.SetDelegateToGeneratedFactory(true);
       self->SetInternalField(1, Nan::New<Array>());
       Wrap(self);
     }
 
     virtual ~Schema() {
+      for (size_t i = 0; i < pools_.size(); i++) {
+        for (size_t j = 0; j < pools_[i].messages.size(); j++) {
+          delete pools_[i].messages[j];
+        }
+      }
+      delete arena_;
+      for (hash_map<const EnumDescriptor*, EnumTable*>::iterator it = enums_.begin();
+           it != enums_.end(); ++it) {
+        delete it->second;
+      }
       if (pool_ != DescriptorPool::generated_pool())
         delete pool_;
+      delete database_;
     }
 
     class Type : public Nan::ObjectWrap {
     public:
       Schema* schema_;
       const Descriptor* descriptor_;
+      int index_;  // in schema_->types_
+
+      struct Field;
+
+      // A JS value converted to the C++ representation of a scalar field,
+      // using the same conversions as ToProto.
+      struct Scalar {
+        union {
+          int32 i32;
+          uint32 u32;
+          int64 i64;
+          uint64 u64;
+          float f;
+          double d;
+          bool b;
+        };
+        // strings and bytes: either a buffer's contents or a JS string
+        const char* data;
+        Local<String> string;
+        int length;
+      };
+
+      // Per-call state of the conversions to JS.
+      struct ParseContext {
+        Int64Mode int64;
+        bool enum_numbers;
+        bool dense;
+        bool zero_copy;
+        bool lazy;
+        bool typed_arrays;
+        const FieldMask* mask;  // for this level of nesting; NULL for all
+
+        // For zero-copy and lazy parses, bytes fields and sub-messages
+        // become slices of the input Buffer "source", whose data starts at
+        // "base".
+        Local<Object> source;
+        Local<Function> slice;
+        const char* base;
+        // the options of the call, handed on to lazy sub-message parses
+        Local<Value> call_options;
+
+        // Only direct parses of a Buffer can be zero-copy or lazy.
+        explicit ParseContext(const ParseOptions& options)
+          : int64(options.int64), enum_numbers(options.enum_numbers),
+            dense(options.dense), zero_copy(false), lazy(false),
+            typed_arrays(options.typed_arrays), mask(options.mask), base(NULL) {}
+
+        ParseContext(const ParseOptions& options, Local<Object> buffer,
+                     Local<Value> call_options = Local<Value>())
+          : int64(options.int64), enum_numbers(options.enum_numbers),
+            dense(options.dense), zero_copy(options.zero_copy), lazy(options.lazy),
+            typed_arrays(options.typed_arrays), mask(options.mask), base(NULL),
+            call_options(call_options) {
+          if (zero_copy || lazy) {
+            source = buffer;
+            slice = source->Get(Nan::New<String>("slice").ToLocalChecked()).As<Function>();
+            base = node::Buffer::Data(buffer);
+          }
+        }
+
+        // the context for the sub-message in field "index"
+        ParseContext Narrow(int index) const {
+          ParseContext context(*this);
+          context.mask = mask->children[index];
+          return context;
+        }
 
+        // a view of the input, which it keeps alive
+        Local<Value> Slice(const void* data, uint32 length) const {
+          int offset = static_cast<const char*>(data) - base;
+          Local<Value> argv[] = {
+            Nan::New<v8::Int32>(offset),
+            Nan::New<v8::Int32>(offset + static_cast<int>(length))
+          };
+          return slice->Call(source, 2, argv);
+        }
+      };
+
+      // Per-field handlers, chosen once when the plan is compiled so the
+      // per-value loops don't switch on the field type.  Message and group
+      // fields have none; they recurse into the child Type instead.
+      //   wire -> JS
+      typedef bool (*ReadFn)(CodedInputStream* input, const Field& f,
+                             const ParseContext& context, Local<Value>* value);
+      //   Message -> JS (index < 0 for singular fields)
+      typedef Local<Value> (*GetFn)(const Message& instance,
+                                    const Reflection* reflection,
+                                    const Field& f, int index,
+                                    const ParseContext& context);
+      //   JS -> Message
+      typedef const char* (*SetFn)(Message* instance,
+                                   const Reflection* reflection,
+                                   const Field& f, Local<Value> value);
+      //   JS -> wire, as conversion, size without tag, and write without tag
+      typedef const char* (*ConvertFn)(const Field& f, Local<Value> value,
+                                       Scalar* out);
+      typedef int (*SizeFn)(const Scalar& value);
+      typedef uint8* (*WriteFn)(const Scalar& value, uint8* target);
+      //   wire -> native, appended to a TypedArray's contents
+      typedef bool (*ReadTypedFn)(CodedInputStream* input, string* elements);
+
+      // The TypedArrays repeated fields can be read as and written from.
+      enum TypedArrayKind {
+        TYPED_NONE,
+        TYPED_INT32,    // Int32Array: int32, sint32, sfixed32
+        TYPED_UINT32,   // Uint32Array: uint32, fixed32
+        TYPED_FLOAT32,  // Float32Array: float
+        TYPED_FLOAT64   // Float64Array: double
+      };
+
+      // Everything the conversions need to know about a field, compiled
+      // from its descriptor when the Type is created.
+      struct Field {
+        const FieldDescriptor* descriptor;
+        int index;  // descriptor order, i.e. slot in the properties array
+        int number;
+        uint32 tag;  // with the field's own (unpacked) wire type
+        int tag_size;  // including the end tag of groups
+        WireFormatLite::WireType wire_type;
+        bool repeated;
+        bool packed;  // serialized packed
+        bool packable;  // repeated primitive, may also arrive packed
+        bool bytes;
+        bool message;  // message or group; uses child instead of handlers
+        bool group;
+        mutable const Type* child;  // resolved on first use
+        Nan::Persistent<String> name;  // internalized camelcase name
+        const EnumTable* enum_table;   // for enum fields
+
+        ReadFn read;
+        GetFn get;
+        SetFn set;
+        ConvertFn convert;
+        SizeFn size;
+        WriteFn write;
+
+        TypedArrayKind typed;  // TYPED_NONE unless repeated and eligible
+        int typed_size;  // bytes per element
+        ReadTypedFn read_typed;
+      };
+
+      // fields_[i] describes descriptor_->field(i)
+      Field* fields_;
+      // indices into fields_ by ascending field number, i.e. wire order
+      vector<int> serialize_order_;
+      // field number -> index in fields_, or -1; only covers small numbers
+      vector<int> fields_by_number_;
+      vector<int> required_;
+      // whether this message or one nested in it has required fields
+      bool has_required_;
+      // compiled "fields" options, by their paths; only the first few
+      // are kept
+      mutable map<string, FieldMask*> masks_;
+
+      struct FieldNumberLess {
+        const Descriptor* descriptor;
+        explicit FieldNumberLess(const Descriptor* d) : descriptor(d) {}
+        bool operator()(int a, int b) const {
+          return descriptor->field(a)->number() < descriptor->field(b)->number();
+        }
+      };
+
+      const Field* FieldByNumber(int number) const {
+        if (number < static_cast<int>(fields_by_number_.size())) {
+          int i = fields_by_number_[number];
+          return i < 0 ? NULL : &fields_[i];
+        }
+        const FieldDescriptor* field = descriptor_->FindFieldByNumber(number);
+        return field ? &fields_[field->index()] : NULL;
+      }
+
+      // by camelcase name as in JS objects, or as declared
+      const Field* FieldByName(const string& name) const {
+        const FieldDescriptor* field = descriptor_->FindFieldByCamelcaseName(name);
+        if (!field) field = descriptor_->FindFieldByName(name);
+        return field ? &fields_[field->index()] : NULL;
+      }
+
+      // Child types are linked lazily: creating them eagerly here would
+      // recurse forever on self-referencing messages.
+      const Type* ChildType(const Field& f) const {
+        if (!f.child) f.child = schema_->GetType(f.descriptor->message_type());
+        return f.child;
+      }
+
+      // Messages come from, and go back to, the schema's pool for this
+      // type.
       Message* NewMessage() const {
         return schema_->NewMessage(descriptor_);
       }
 
+      Message* AcquireMessage() const {
+        return schema_->AcquireMessage(index_, descriptor_);
+      }
+
+      void ReleaseMessage(Message* message) const {
+        if (message) schema_->ReleaseMessage(index_, message);
+      }
+
       Local<Function> Constructor() const {
         Local<Object> handle = const_cast<Type *>(this)->handle();
         return handle->GetInternalField(2).As<Function>();
       }
 
-      Local<Object> NewObject(Local<Value> properties) const {
-        return Nan::NewInstance(Constructor(), 1, &properties).ToLocalChecked();
+      Local<Object> NewObject(Local<Value> properties, const ParseContext& context) const {
+        Local<Object> handle = const_cast<Type *>(this)->handle();
+        Local<Function> constructor = context.dense ?
+          handle->GetInternalField(4).As<Function>() : Constructor();
+        return Nan::NewInstance(constructor, 1, &properties).ToLocalChecked();
       }
 
-      Type(Schema* schema, const Descriptor* descriptor, Local<Object> self)
-        : schema_(schema), descriptor_(descriptor) {
+      Type(Schema* schema, const Descriptor* descriptor, int index, Local<Object> self)
+        : schema_(schema), descriptor_(descriptor), index_(index) {
+        // Field numbers are usually small and dense; anything past this
+        // falls back to the descriptor's own lookup.
+        static const int kMaxDenseNumber = 256;
+
+        fields_ = new Field[descriptor->field_count()];
+        for (int i = 0; i < descriptor->field_count(); i++) {
+          const FieldDescriptor* field = descriptor->field(i);
+          CompileField(field, &fields_[i]);
+
+          if (field->number() < kMaxDenseNumber) {
+            if (field->number() >= static_cast<int>(fields_by_number_.size()))
+              fields_by_number_.resize(field->number() + 1, -1);
+            fields_by_number_[field->number()] = i;
+          }
+          if (field->is_required()) required_.push_back(i);
+          serialize_order_.push_back(i);
+        }
+        std::sort(serialize_order_.begin(), serialize_order_.end(),
+                  FieldNumberLess(descriptor));
+        std::set<const Descriptor*> visited;
+        has_required_ = HasRequiredFields(descriptor, &visited);
+
         // Generate functions for bulk conversion between a JS object
         // and an array in descriptor order:
         //   from = function(arr) { this.f0 = arr[0]; this.f1 = arr[1]; ... }
         //   to   = function()    { return [ this.f0, this.f1, ... ] }
         // This is faster than repeatedly calling Get/Set on a v8::Object.
-        std::ostringstream from, to;
+        // For dense results, a second constructor assigns every field
+        // whether set or not, so all objects of a Type share one hidden
+        // class:
+        //   dense = function(arr) { this.f0 = arr[0]; this.f1 = arr[1]; ... }
+        // Message fields of lazy parses may still be encoded:
+        //   to   = function() { var r = this[raw];
+        //                       return [ r && r.m0 !== undefined ? r.m0 : this.m0, ... ] }
+        std::ostringstream from, to, dense;
         from << "(function(arr) { if(arr) {";
-        to << "(function() { return [ ";
+        to << "(function(raw) { return function() { var r = this[raw]; return [ ";
+        dense << "(function(arr) { ";
 
         for (int i = 0; i < descriptor->field_count(); i++) {
           from <<
@@ -127,12 +538,20 @@ namespace protobuf_for_node {
             descriptor->field(i)->camelcase_name() <<
             "'] = x; ";
 
+          const string& name = descriptor->field(i)->camelcase_name();
           if (i > 0) to << ", ";
-          to << "this['" << descriptor->field(i)->camelcase_name() << "']";
+          if (fields_[i].message && !fields_[i].group) {
+            to << "r && r['" << name << "'] !== undefined ? r['" << name << "'] : ";
+          }
+          to << "this['" << name << "']";
+
+          dense << "this['" << descriptor->field(i)->camelcase_name() <<
+            "'] = arr[" << i << "]; ";
         }
 
         from << " }})";
-        to << " ]; })";
+        to << " ]; }; })";
+        dense << "})";
 
         // managed type->schema link
         self->SetInternalField(1, schema_->handle());
@@ -145,269 +564,2447 @@ namespace protobuf_for_node {
           Script::Compile(Nan::New<String>(
               "(function(self) {"
               "  var f = this;"
-              "  return function(arg) {"
-              "    return f.call(self, arg);"
+              "  return function() {"
+              "    return f.apply(self, arguments);"
+              "  };"
+              "})").ToLocalChecked())->Run().As<Function>();
+        // Async methods take optional options and a node-style callback,
+        // or return a Promise when called without one.
+        Local<Function> bind_async =
+          Script::Compile(Nan::New<String>(
+              "(function(self) {"
+              "  var f = this;"
+              "  return function(arg, options, cb) {"
+              "    if (typeof options === 'function') { cb = options; options = undefined; }"
+              "    if (typeof cb === 'function') return f.call(self, arg, options, cb);"
+              "    return new Promise(function(resolve, reject) {"
+              "      f.call(self, arg, options, function(err, result) {"
+              "        if (err) reject(err); else resolve(result);"
+              "      });"
+              "    });"
               "  };"
               "})").ToLocalChecked())->Run().As<Function>();
-        Local<Value> arg = self;
-
-        Local<FunctionTemplate> parseTemplate = Nan::New(ParseTemplate);
-        Local<FunctionTemplate> serializeTemplate = Nan::New(SerializeTemplate);
 
-        constructor->Set(Nan::New<String>("parse").ToLocalChecked(), bind->Call(parseTemplate->GetFunction(), 1, &arg));
-        constructor->Set(Nan::New<String>("serialize").ToLocalChecked(), bind->Call(serializeTemplate->GetFunction(), 1, &arg));
+        SetMethod(constructor, bind, self, "parse", ParseTemplate);
+        SetMethod(constructor, bind, self, "serialize", SerializeTemplate);
+        SetMethod(constructor, bind, self, "serializeInto", SerializeIntoTemplate);
+        SetMethod(constructor, bind, self, "byteSize", ByteSizeTemplate);
+        SetMethod(constructor, bind, self, "serializev", SerializeVTemplate);
+        SetMethod(constructor, bind, self, "parseMany", ParseManyTemplate);
+        SetMethod(constructor, bind, self, "parseDelimited", ParseDelimitedTemplate);
+        SetMethod(constructor, bind, self, "serializeDelimited", SerializeDelimitedTemplate);
+        SetMethod(constructor, bind, self, "decoder", NewDecoderTemplate);
+        SetMethod(constructor, bind, self, "poolStats", PoolStatsTemplate);
+        SetMethod(constructor, bind, self, "peek", PeekTemplate);
+        SetMethod(constructor, bind, self, "mask", NewMaskTemplate);
+        SetMethod(constructor, bind_async, self, "parseAsync", ParseAsyncTemplate);
+        SetMethod(constructor, bind_async, self, "serializeAsync", SerializeAsyncTemplate);
         self->SetInternalField(2, constructor);
-        self->SetInternalField(3, Script::Compile(Nan::New<String>(to.str()).ToLocalChecked())->Run());
+        Local<Value> raw =
+          Nan::New(LazyHelper)->Get(Nan::New<String>("raw").ToLocalChecked());
+        Local<Function> to_factory =
+          Script::Compile(Nan::New<String>(to.str()).ToLocalChecked())->Run().As<Function>();
+        self->SetInternalField(3, to_factory->Call(to_factory, 1, &raw));
+
+        // dense results are still instances of the Type
+        Local<Function> dense_constructor =
+          Script::Compile(Nan::New<String>(dense.str()).ToLocalChecked())->Run().As<Function>();
+        Local<String> prototype = Nan::New<String>("prototype").ToLocalChecked();
+        dense_constructor->Set(prototype, constructor->Get(prototype));
+        self->SetInternalField(4, dense_constructor);
 
         Wrap(self);
       }
 
-#define GET(TYPE)                                                        \
-      (index >= 0 ?                                                      \
-       reflection->GetRepeated##TYPE(instance, field, index) :           \
-       reflection->Get##TYPE(instance, field))
-
-      static Local<Value> ToJs(const Message& instance,
-                                const Reflection* reflection,
-                                const FieldDescriptor* field,
-                                const Type* message_type,
-                                int index) {
-        switch (field->cpp_type()) {
-        case FieldDescriptor::CPPTYPE_MESSAGE:
-          return message_type->ToJs(GET(Message));
-        case FieldDescriptor::CPPTYPE_STRING: {
-          const string& value = GET(String);
-          if (field->type() == FieldDescriptor::TYPE_BYTES) {
-            return Nan::CopyBuffer(const_cast<char *>(value.data()), value.length()).ToLocalChecked();
-          } else {
-            return Nan::New<String>(value.data(), value.length()).ToLocalChecked();
+      virtual ~Type() {
+        for (map<string, FieldMask*>::iterator it = masks_.begin();
+             it != masks_.end(); ++it) {
+          delete it->second;
+        }
+        delete[] fields_;
+      }
+
+      // constructor[name] = method bound to this Type
+      static void SetMethod(Local<Function> constructor,
+                            Local<Function> bind,
+                            Local<Value> self,
+                            const char* name,
+                            const Nan::Persistent<FunctionTemplate>& method) {
+        Local<FunctionTemplate> t = Nan::New(method);
+        constructor->Set(Nan::New<String>(name).ToLocalChecked(),
+                         bind->Call(t->GetFunction(), 1, &self));
+      }
+
+      // value conversions shared by all handlers
+
+      // Number.MAX_SAFE_INTEGER
+      static const int64 kMaxSafeInteger = (GOOGLE_LONGLONG(1) << 53) - 1;
+
+      // In string mode, and for inexact Numbers, 64 bit integers are
+      // formatted into a stack buffer and become one-byte strings.
+      static Local<Value> Int64ToJs(int64 value, Int64Mode mode) {
+        if (mode == INT64_NUMBER &&
+            value >= -kMaxSafeInteger && value <= kMaxSafeInteger) {
+          return Nan::New<Number>(static_cast<double>(value));
+        }
+#if PROTOBUF_FOR_NODE_BIGINT
+        if (mode == INT64_BIGINT) {
+          return v8::BigInt::New(v8::Isolate::GetCurrent(), value);
+        }
+#endif
+        char buffer[kFastToBufferSize];
+        char* end = google::protobuf::FastInt64ToBufferLeft(value, buffer);
+        return Nan::NewOneByteString(reinterpret_cast<const uint8*>(buffer),
+                                     end - buffer).ToLocalChecked();
+      }
+
+      static Local<Value> UInt64ToJs(uint64 value, Int64Mode mode) {
+        if (mode == INT64_NUMBER &&
+            value <= static_cast<uint64>(kMaxSafeInteger)) {
+          return Nan::New<Number>(static_cast<double>(value));
+        }
+#if PROTOBUF_FOR_NODE_BIGINT
+        if (mode == INT64_BIGINT) {
+          return v8::BigInt::NewFromUnsigned(v8::Isolate::GetCurrent(), value);
+        }
+#endif
+        char buffer[kFastToBufferSize];
+        char* end = google::protobuf::FastUInt64ToBufferLeft(value, buffer);
+        return Nan::NewOneByteString(reinterpret_cast<const uint8*>(buffer),
+                                     end - buffer).ToLocalChecked();
+      }
+
+      // A JS string as a NUL-terminated C string; on the stack unless it
+      // is too long to be a number.
+      class CString {
+      public:
+        explicit CString(Local<String> value) : data_(stack_) {
+          int length = value->Utf8Length();
+          if (length >= kFastToBufferSize) {
+            heap_.resize(length + 1);
+            data_ = &heap_[0];
+          }
+          value->WriteUtf8(data_, length, NULL, String::NO_NULL_TERMINATION);
+          data_[length] = '\0';
+        }
+
+        const char* data() const { return data_; }
+
+      private:
+        char stack_[kFastToBufferSize];
+        vector<char> heap_;
+        char* data_;
+      };
+
+      static int64 ToInt64(Local<Value> value) {
+#if PROTOBUF_FOR_NODE_BIGINT
+        if (value->IsBigInt()) {
+          return value.As<v8::BigInt>()->Int64Value();
+        }
+#endif
+        if (value->IsString()) {
+          return google::protobuf::strto64(CString(value.As<String>()).data(), NULL, 10);
+        }
+        return value->NumberValue();
+      }
+
+      static uint64 ToUInt64(Local<Value> value) {
+#if PROTOBUF_FOR_NODE_BIGINT
+        if (value->IsBigInt()) {
+          return value.As<v8::BigInt>()->Uint64Value();
+        }
+#endif
+        if (value->IsString()) {
+          return google::protobuf::strtou64(CString(value.As<String>()).data(), NULL, 10);
+        }
+        return value->NumberValue();
+      }
+
+      static Local<Value> ToJsValue(int32 value, const ParseContext& context) {
+        return Nan::New<v8::Int32>(value);
+      }
+      static Local<Value> ToJsValue(uint32 value, const ParseContext& context) {
+        return Nan::New<v8::Uint32>(value);
+      }
+      static Local<Value> ToJsValue(int64 value, const ParseContext& context) {
+        return Int64ToJs(value, context.int64);
+      }
+      static Local<Value> ToJsValue(uint64 value, const ParseContext& context) {
+        return UInt64ToJs(value, context.int64);
+      }
+      static Local<Value> ToJsValue(float value, const ParseContext& context) {
+        return Nan::New<Number>(value);
+      }
+      static Local<Value> ToJsValue(double value, const ParseContext& context) {
+        return Nan::New<Number>(value);
+      }
+      static Local<Value> ToJsValue(bool value, const ParseContext& context) {
+        if (value) {
+          return Nan::True();
+        }
+        return Nan::False();
+      }
+
+      static Local<Value> ToJsValue(const Field& f, const string& value) {
+        if (f.bytes) {
+          return Nan::CopyBuffer(const_cast<char *>(value.data()), value.length()).ToLocalChecked();
+        } else {
+          return Nan::New<String>(value.data(), value.length()).ToLocalChecked();
+        }
+      }
+
+      // ReadFn: wire -> JS
+
+      template <typename CType, WireFormatLite::FieldType DeclaredType>
+      static bool ReadPrimitive(CodedInputStream* input, const Field& f,
+                                const ParseContext& context, Local<Value>* value) {
+        CType v;
+        if (!WireFormatLite::ReadPrimitive<CType, DeclaredType>(input, &v))
+          return false;
+        *value = ToJsValue(v, context);
+        return true;
+      }
+
+      // ReadTypedFn
+      template <typename CType, WireFormatLite::FieldType DeclaredType>
+      static bool ReadTyped(CodedInputStream* input, string* elements) {
+        CType v;
+        if (!WireFormatLite::ReadPrimitive<CType, DeclaredType>(input, &v))
+          return false;
+        elements->append(reinterpret_cast<const char*>(&v), sizeof(v));
+        return true;
+      }
+
+      // A TypedArray of the field's kind over a copy of "size" bytes of
+      // elements.
+      static Local<Value> NewTypedArray(const Field& f, const char* elements,
+                                        size_t size) {
+        Local<v8::ArrayBuffer> buffer =
+          v8::ArrayBuffer::New(v8::Isolate::GetCurrent(), size);
+        if (size > 0) memcpy(buffer->GetContents().Data(), elements, size);
+        size_t length = size / f.typed_size;
+        switch (f.typed) {
+        case TYPED_INT32:
+          return v8::Int32Array::New(buffer, 0, length);
+        case TYPED_UINT32:
+          return v8::Uint32Array::New(buffer, 0, length);
+        case TYPED_FLOAT32:
+          return v8::Float32Array::New(buffer, 0, length);
+        case TYPED_FLOAT64:
+        default:
+          return v8::Float64Array::New(buffer, 0, length);
+        }
+      }
+
+      // The elements of a TypedArray of the field's kind, or false for
+      // anything else.
+      static bool GetTypedElements(const Field& f, Local<Value> value,
+                                   const char** data, int* length) {
+        bool match;
+        switch (f.typed) {
+        case TYPED_INT32: match = value->IsInt32Array(); break;
+        case TYPED_UINT32: match = value->IsUint32Array(); break;
+        case TYPED_FLOAT32: match = value->IsFloat32Array(); break;
+        case TYPED_FLOAT64: match = value->IsFloat64Array(); break;
+        default: match = false; break;
+        }
+        if (!match) return false;
+        Local<v8::TypedArray> array = value.As<v8::TypedArray>();
+        *data = static_cast<const char*>(array->Buffer()->GetContents().Data()) +
+          array->ByteOffset();
+        *length = array->Length();
+        return true;
+      }
+
+      // Element "index" of TypedArray contents, for the field's handlers.
+      static Scalar TypedElement(const Field& f, const char* data, int index) {
+        Scalar scalar;
+        const char* element = data + index * f.typed_size;
+        switch (f.typed) {
+        case TYPED_INT32: memcpy(&scalar.i32, element, sizeof(int32)); break;
+        case TYPED_UINT32: memcpy(&scalar.u32, element, sizeof(uint32)); break;
+        case TYPED_FLOAT32: memcpy(&scalar.f, element, sizeof(float)); break;
+        default: memcpy(&scalar.d, element, sizeof(double)); break;
+        }
+        return scalar;
+      }
+
+      // The storage of a repeated field of a typed kind, as exposed by
+      // GetRawRepeatedPrimitive().
+      template <typename CType>
+      static const char* RawElements(const void* raw) {
+        return reinterpret_cast<const char*>(
+            static_cast<const RepeatedField<CType>*>(raw)->data());
+      }
+
+      // Appends "length" elements to the storage exposed by
+      // MutableRawRepeatedPrimitive().
+      template <typename CType>
+      static void AddRawElements(void* raw, const char* elements, int length) {
+        RepeatedField<CType>* field = static_cast<RepeatedField<CType>*>(raw);
+        field->Reserve(field->size() + length);
+        memcpy(field->AddNAlreadyReserved(length), elements,
+               length * sizeof(CType));
+      }
+
+      // Leaves *value empty for numbers unknown to the enum, which proto2
+      // drops.
+      static bool ReadEnum(CodedInputStream* input, const Field& f,
+                           const ParseContext& context, Local<Value>* value) {
+        int v;
+        if (!WireFormatLite::ReadPrimitive<int, WireFormatLite::TYPE_ENUM>(input, &v))
+          return false;
+        const EnumValueDescriptor* enum_value =
+          f.descriptor->enum_type()->FindValueByNumber(v);
+        if (!enum_value) return true;
+        if (context.enum_numbers) {
+          *value = Nan::New<v8::Int32>(v);
+        } else {
+          *value = f.enum_table->Name(enum_value);
+        }
+        return true;
+      }
+
+      static bool ReadString(CodedInputStream* input, const Field& f,
+                             const ParseContext& context, Local<Value>* value) {
+        uint32 length;
+        if (!input->ReadVarint32(&length)) return false;
+        const void* data = "";
+        int available = 0;
+        if (length > 0 &&
+            (!input->GetDirectBufferPointer(&data, &available) ||
+             static_cast<uint32>(available) < length)) {
+          return false;
+        }
+        if (f.bytes && context.zero_copy) {
+          *value = context.Slice(data, length);
+        } else if (f.bytes) {
+          *value = Nan::CopyBuffer(static_cast<const char*>(data), length).ToLocalChecked();
+        } else {
+          *value = Nan::New<String>(static_cast<const char*>(data), length).ToLocalChecked();
+        }
+        input->Skip(length);
+        return true;
+      }
+
+      // GetFn: Message -> JS
+
+#define GETTER(METHOD)                                                   \
+      static Local<Value> Get##METHOD(const Message& instance,           \
+                                      const Reflection* reflection,      \
+                                      const Field& f, int index,         \
+                                      const ParseContext& context) {     \
+        return ToJsValue(index >= 0 ?                                    \
+          reflection->GetRepeated##METHOD(instance, f.descriptor, index) : \
+          reflection->Get##METHOD(instance, f.descriptor), context);     \
+      }
+
+      GETTER(Int32)
+      GETTER(UInt32)
+      GETTER(Int64)
+      GETTER(UInt64)
+      GETTER(Float)
+      GETTER(Double)
+      GETTER(Bool)
+#undef GETTER
+
+      static Local<Value> GetEnum(const Message& instance,
+                                  const Reflection* reflection,
+                                  const Field& f, int index,
+                                  const ParseContext& context) {
+        const EnumValueDescriptor* value = index >= 0 ?
+          reflection->GetRepeatedEnum(instance, f.descriptor, index) :
+          reflection->GetEnum(instance, f.descriptor);
+        if (context.enum_numbers) {
+          return Nan::New<v8::Int32>(value->number());
+        }
+        return f.enum_table->Name(value);
+      }
+
+      static Local<Value> GetString(const Message& instance,
+                                    const Reflection* reflection,
+                                    const Field& f, int index,
+                                    const ParseContext& context) {
+        string scratch;
+        const string& value = index >= 0 ?
+          reflection->GetRepeatedStringReference(instance, f.descriptor, index, &scratch) :
+          reflection->GetStringReference(instance, f.descriptor, &scratch);
+        return ToJsValue(f, value);
+      }
+
+      // SetFn: JS -> Message
+
+#define SETTER(METHOD, EXPR)                                             \
+      static const char* Set##METHOD(Message* instance,                  \
+                                     const Reflection* reflection,       \
+                                     const Field& f, Local<Value> value) { \
+        if (f.repeated) reflection->Add##METHOD(instance, f.descriptor, EXPR); \
+        else reflection->Set##METHOD(instance, f.descriptor, EXPR);      \
+        return NULL;                                                     \
+      }
+
+      SETTER(Int32, value->Int32Value())
+      SETTER(UInt32, value->Uint32Value())
+      SETTER(Int64, ToInt64(value))
+      SETTER(UInt64, ToUInt64(value))
+      SETTER(Float, value->NumberValue())
+      SETTER(Double, value->NumberValue())
+      SETTER(Bool, value->BooleanValue())
+#undef SETTER
+
+      static const char* SetEnum(Message* instance,
+                                 const Reflection* reflection,
+                                 const Field& f, Local<Value> value) {
+        const EnumValueDescriptor* enum_value = f.enum_table->Find(value);
+        if (!enum_value) {
+          return E_UNKNOWN_ENUM;
+        }
+        if (f.repeated) reflection->AddEnum(instance, f.descriptor, enum_value);
+        else reflection->SetEnum(instance, f.descriptor, enum_value);
+        return NULL;
+      }
+
+      static const char* SetString(Message* instance,
+                                   const Reflection* reflection,
+                                   const Field& f, Local<Value> value) {
+        string s;
+        // Shortcutting Utf8value(buffer.toString())
+        if (node::Buffer::HasInstance(value)) {
+          Local<Object> buf = value->ToObject();
+          s.assign(node::Buffer::Data(buf), node::Buffer::Length(buf));
+        } else {
+          // straight into the string, rather than through a Utf8Value
+          Local<String> string = value->ToString();
+          s.resize(string->Utf8Length());
+          if (!s.empty()) {
+            WriteUtf8(string, s.size(), reinterpret_cast<uint8*>(&s[0]));
           }
         }
-        case FieldDescriptor::CPPTYPE_INT32:
-          return Nan::New<v8::Int32>(GET(Int32));
-        case FieldDescriptor::CPPTYPE_UINT32:
-          return Nan::New<v8::Uint32>(GET(UInt32));
-        case FieldDescriptor::CPPTYPE_INT64: {
-          std::ostringstream ss;
-          ss << GET(Int64);
-          string s = ss.str();
-          return Nan::New<String>(s.data(), s.length()).ToLocalChecked();
+        if (f.repeated) reflection->AddString(instance, f.descriptor, s);
+        else reflection->SetString(instance, f.descriptor, s);
+        return NULL;
+      }
+
+      // ConvertFn: JS -> Scalar
+
+#define CONVERTER(METHOD, MEMBER, EXPR)                                  \
+      static const char* Convert##METHOD(const Field& f,                 \
+                                         Local<Value> value,             \
+                                         Scalar* out) {                  \
+        out->MEMBER = EXPR;                                              \
+        return NULL;                                                     \
+      }
+
+      CONVERTER(Int32, i32, value->Int32Value())
+      CONVERTER(UInt32, u32, value->Uint32Value())
+      CONVERTER(Int64, i64, ToInt64(value))
+      CONVERTER(UInt64, u64, ToUInt64(value))
+      CONVERTER(Float, f, value->NumberValue())
+      CONVERTER(Double, d, value->NumberValue())
+      CONVERTER(Bool, b, value->BooleanValue())
+#undef CONVERTER
+
+      static const char* ConvertEnum(const Field& f, Local<Value> value,
+                                     Scalar* out) {
+        const EnumValueDescriptor* enum_value = f.enum_table->Find(value);
+        if (!enum_value) {
+          return E_UNKNOWN_ENUM;
+        }
+        out->i32 = enum_value->number();
+        return NULL;
+      }
+
+      static const char* ConvertString(const Field& f, Local<Value> value,
+                                       Scalar* out) {
+        // Shortcutting Utf8value(buffer.toString())
+        if (node::Buffer::HasInstance(value)) {
+          Local<Object> buf = value->ToObject();
+          out->data = node::Buffer::Data(buf);
+          out->length = node::Buffer::Length(buf);
+        } else {
+          out->data = NULL;
+          out->string = value->ToString();
+          out->length = out->string->Utf8Length();
+        }
+        return NULL;
+      }
+
+      // SizeFn and WriteFn: Scalar -> wire
+
+#define CODEC(METHOD, MEMBER, SIZE)                                      \
+      static int Size##METHOD(const Scalar& value) {                     \
+        return SIZE;                                                     \
+      }                                                                  \
+      static uint8* Write##METHOD(const Scalar& value, uint8* target) {  \
+        return WireFormatLite::Write##METHOD##NoTagToArray(value.MEMBER, target); \
+      }
+
+      CODEC(Int32, i32, WireFormatLite::Int32Size(value.i32))
+      CODEC(SInt32, i32, WireFormatLite::SInt32Size(value.i32))
+      CODEC(SFixed32, i32, WireFormatLite::kSFixed32Size)
+      CODEC(UInt32, u32, WireFormatLite::UInt32Size(value.u32))
+      CODEC(Fixed32, u32, WireFormatLite::kFixed32Size)
+      CODEC(Int64, i64, WireFormatLite::Int64Size(value.i64))
+      CODEC(SInt64, i64, WireFormatLite::SInt64Size(value.i64))
+      CODEC(SFixed64, i64, WireFormatLite::kSFixed64Size)
+      CODEC(UInt64, u64, WireFormatLite::UInt64Size(value.u64))
+      CODEC(Fixed64, u64, WireFormatLite::kFixed64Size)
+      CODEC(Float, f, WireFormatLite::kFloatSize)
+      CODEC(Double, d, WireFormatLite::kDoubleSize)
+      CODEC(Bool, b, WireFormatLite::kBoolSize)
+      CODEC(Enum, i32, WireFormatLite::EnumSize(value.i32))
+#undef CODEC
+
+      static int SizeString(const Scalar& value) {
+        return CodedOutputStream::VarintSize32(value.length) + value.length;
+      }
+
+      // Writes the "length" bytes of UTF-8 of "string".  A one-byte string
+      // whose UTF-8 is as long as it is holds only ASCII, which is copied
+      // as it is.  Returns false if "length" was wrong.
+      static bool WriteUtf8(Local<String> string, int length, uint8* target) {
+        if (string->IsOneByte() && string->Length() == length) {
+          return string->WriteOneByte(target, 0, length,
+                                      String::NO_NULL_TERMINATION) == length;
+        }
+        return string->WriteUtf8(reinterpret_cast<char*>(target), length, NULL,
+                                 String::NO_NULL_TERMINATION) == length;
+      }
+
+      // Returns NULL if a string no longer has the length it was sized with.
+      static uint8* WriteString(const Scalar& value, uint8* target) {
+        target = CodedOutputStream::WriteVarint32ToArray(value.length, target);
+        if (value.data) {
+          memcpy(target, value.data, value.length);
+        } else if (!WriteUtf8(value.string, value.length, target)) {
+          return NULL;
+        }
+        return target + value.length;
+      }
+
+      void CompileField(const FieldDescriptor* field, Field* f) const {
+        f->descriptor = field;
+        f->index = field->index();
+        f->number = field->number();
+        f->wire_type = WireFormatLite::WireTypeForFieldType(
+            static_cast<WireFormatLite::FieldType>(field->type()));
+        f->tag = WireFormatLite::MakeTag(field->number(), f->wire_type);
+        f->tag_size = WireFormatLite::TagSize(field->number(),
+            static_cast<WireFormatLite::FieldType>(field->type()));
+        f->repeated = field->is_repeated();
+        f->packed = field->options().packed();
+        f->packable = f->repeated &&
+          f->wire_type != WireFormatLite::WIRETYPE_LENGTH_DELIMITED &&
+          f->wire_type != WireFormatLite::WIRETYPE_START_GROUP;
+        f->bytes = field->type() == FieldDescriptor::TYPE_BYTES;
+        f->message = field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE;
+        f->group = field->type() == FieldDescriptor::TYPE_GROUP;
+        f->child = NULL;
+        f->enum_table = field->cpp_type() == FieldDescriptor::CPPTYPE_ENUM ?
+          schema_->GetEnumTable(field->enum_type()) : NULL;
+        f->name.Reset(String::NewFromUtf8(v8::Isolate::GetCurrent(),
+                                          field->camelcase_name().c_str(),
+                                          String::kInternalizedString));
+        f->read = NULL;
+        f->get = NULL;
+        f->set = NULL;
+        f->convert = NULL;
+        f->size = NULL;
+        f->write = NULL;
+        f->typed = TYPED_NONE;
+        f->typed_size = 0;
+        f->read_typed = NULL;
+
+#define HANDLERS(CPPTYPE, METHOD)                                        \
+        f->get = &Get##CPPTYPE;                                          \
+        f->set = &Set##CPPTYPE;                                          \
+        f->convert = &Convert##CPPTYPE;                                  \
+        f->size = &Size##METHOD;                                         \
+        f->write = &Write##METHOD
+
+#define PRIMITIVE(CPPTYPE, METHOD, CTYPE, FTYPE)                         \
+        HANDLERS(CPPTYPE, METHOD);                                       \
+        f->read = &ReadPrimitive<CTYPE, WireFormatLite::FTYPE>
+
+#define TYPED(KIND, CTYPE, FTYPE)                                        \
+        if (f->repeated) {                                               \
+          f->typed = KIND;                                               \
+          f->typed_size = sizeof(CTYPE);                                 \
+          f->read_typed = &ReadTyped<CTYPE, WireFormatLite::FTYPE>;      \
+        }
+
+        switch (field->type()) {
+        case FieldDescriptor::TYPE_INT32:
+          PRIMITIVE(Int32, Int32, int32, TYPE_INT32);
+          TYPED(TYPED_INT32, int32, TYPE_INT32);
+          break;
+        case FieldDescriptor::TYPE_SINT32:
+          PRIMITIVE(Int32, SInt32, int32, TYPE_SINT32);
+          TYPED(TYPED_INT32, int32, TYPE_SINT32);
+          break;
+        case FieldDescriptor::TYPE_SFIXED32:
+          PRIMITIVE(Int32, SFixed32, int32, TYPE_SFIXED32);
+          TYPED(TYPED_INT32, int32, TYPE_SFIXED32);
+          break;
+        case FieldDescriptor::TYPE_UINT32:
+          PRIMITIVE(UInt32, UInt32, uint32, TYPE_UINT32);
+          TYPED(TYPED_UINT32, uint32, TYPE_UINT32);
+          break;
+        case FieldDescriptor::TYPE_FIXED32:
+          PRIMITIVE(UInt32, Fixed32, uint32, TYPE_FIXED32);
+          TYPED(TYPED_UINT32, uint32, TYPE_FIXED32);
+          break;
+        case FieldDescriptor::TYPE_INT64:
+          PRIMITIVE(Int64, Int64, int64, TYPE_INT64);
+          break;
+        case FieldDescriptor::TYPE_SINT64:
+          PRIMITIVE(Int64, SInt64, int64, TYPE_SINT64);
+          break;
+        case FieldDescriptor::TYPE_SFIXED64:
+          PRIMITIVE(Int64, SFixed64, int64, TYPE_SFIXED64);
+          break;
+        case FieldDescriptor::TYPE_UINT64:
+          PRIMITIVE(UInt64, UInt64, uint64, TYPE_UINT64);
+          break;
+        case FieldDescriptor::TYPE_FIXED64:
+          PRIMITIVE(UInt64, Fixed64, uint64, TYPE_FIXED64);
+          break;
+        case FieldDescriptor::TYPE_FLOAT:
+          PRIMITIVE(Float, Float, float, TYPE_FLOAT);
+          TYPED(TYPED_FLOAT32, float, TYPE_FLOAT);
+          break;
+        case FieldDescriptor::TYPE_DOUBLE:
+          PRIMITIVE(Double, Double, double, TYPE_DOUBLE);
+          TYPED(TYPED_FLOAT64, double, TYPE_DOUBLE);
+          break;
+        case FieldDescriptor::TYPE_BOOL:
+          PRIMITIVE(Bool, Bool, bool, TYPE_BOOL);
+          break;
+        case FieldDescriptor::TYPE_ENUM:
+          HANDLERS(Enum, Enum);
+          f->read = &ReadEnum;
+          break;
+        case FieldDescriptor::TYPE_STRING:
+        case FieldDescriptor::TYPE_BYTES:
+          HANDLERS(String, String);
+          f->read = &ReadString;
+          break;
+        case FieldDescriptor::TYPE_MESSAGE:
+        case FieldDescriptor::TYPE_GROUP:
+          break;
         }
-        case FieldDescriptor::CPPTYPE_UINT64: {
-          std::ostringstream ss;
-          ss << GET(UInt64);
-          string s = ss.str();
-          return Nan::New<String>(s.data(), s.length()).ToLocalChecked();
+#undef TYPED
+#undef PRIMITIVE
+#undef HANDLERS
+      }
+
+      // Message -> JS
+
+      Local<Value> ToJs(const Message& instance,
+                        const Reflection* reflection,
+                        const Field& f,
+                        int index,
+                        const ParseContext& context) const {
+        if (f.message) {
+          const Message& message = index >= 0 ?
+            reflection->GetRepeatedMessage(instance, f.descriptor, index) :
+            reflection->GetMessage(instance, f.descriptor);
+          if (context.mask) return ChildType(f)->ToJs(message, context.Narrow(f.index));
+          return ChildType(f)->ToJs(message, context);
         }
-        case FieldDescriptor::CPPTYPE_FLOAT:
-          return Nan::New<Number>(GET(Float));
-        case FieldDescriptor::CPPTYPE_DOUBLE:
-          return Nan::New<Number>(GET(Double));
-        case FieldDescriptor::CPPTYPE_BOOL:
-          if (GET(Bool)) {
-            return Nan::True();
+        return f.get(instance, reflection, f, index, context);
+      }
+
+      static Local<Value> GetTypedArray(const Message& instance,
+                                        const Reflection* reflection,
+                                        const Field& f) {
+        int size = reflection->FieldSize(instance, f.descriptor);
+        const void* raw = reflection->GetRawRepeatedPrimitive(instance, f.descriptor);
+        if (raw) {
+          const char* elements;
+          switch (f.typed) {
+          case TYPED_INT32: elements = RawElements<int32>(raw); break;
+          case TYPED_UINT32: elements = RawElements<uint32>(raw); break;
+          case TYPED_FLOAT32: elements = RawElements<float>(raw); break;
+          default: elements = RawElements<double>(raw); break;
           }
-          return Nan::False();
-        case FieldDescriptor::CPPTYPE_ENUM:
-          return Nan::New<String>(GET(Enum)->name().c_str()).ToLocalChecked();
+          return NewTypedArray(f, elements, size * f.typed_size);
         }
 
-        return Nan::Undefined();  // NOTREACHED
+        string elements;
+        elements.reserve(size * f.typed_size);
+        for (int j = 0; j < size; j++) {
+          Scalar scalar;
+          switch (f.typed) {
+          case TYPED_INT32:
+            scalar.i32 = reflection->GetRepeatedInt32(instance, f.descriptor, j);
+            elements.append(reinterpret_cast<const char*>(&scalar.i32), sizeof(int32));
+            break;
+          case TYPED_UINT32:
+            scalar.u32 = reflection->GetRepeatedUInt32(instance, f.descriptor, j);
+            elements.append(reinterpret_cast<const char*>(&scalar.u32), sizeof(uint32));
+            break;
+          case TYPED_FLOAT32:
+            scalar.f = reflection->GetRepeatedFloat(instance, f.descriptor, j);
+            elements.append(reinterpret_cast<const char*>(&scalar.f), sizeof(float));
+            break;
+          default:
+            scalar.d = reflection->GetRepeatedDouble(instance, f.descriptor, j);
+            elements.append(reinterpret_cast<const char*>(&scalar.d), sizeof(double));
+            break;
+          }
+        }
+        return NewTypedArray(f, elements.data(), elements.size());
       }
-#undef GET
 
-      Local<Object> ToJs(const Message& instance) const {
+      Local<Object> ToJs(const Message& instance, const ParseContext& context) const {
         const Reflection* reflection = instance.GetReflection();
-        const Descriptor* descriptor = instance.GetDescriptor();
 
-        Local<Array> properties = Nan::New<Array>(descriptor->field_count());
-        for (int i = 0; i < descriptor->field_count(); i++) {
+        Local<Array> properties = Nan::New<Array>(descriptor_->field_count());
+        for (int i = 0; i < descriptor_->field_count(); i++) {
           Nan::HandleScope scope;
 
-          const FieldDescriptor* field = descriptor->field(i);
-          bool repeated = field->is_repeated();
-          if (repeated && !reflection->FieldSize(instance, field)) continue;
-          if (!repeated && !reflection->HasField(instance, field)) continue;
-
-          const Type* child_type =
-            (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) ?
-            schema_->GetType(field->message_type()) : NULL;
+          const Field& f = fields_[i];
+          if (context.mask && !context.mask->include[i]) continue;
+          if (f.repeated && !reflection->FieldSize(instance, f.descriptor)) continue;
+          if (!f.repeated && !reflection->HasField(instance, f.descriptor)) continue;
 
           Local<Value> value;
-          if (field->is_repeated()) {
-            int size = reflection->FieldSize(instance, field);
+          if (f.repeated && f.typed && context.typed_arrays) {
+            value = GetTypedArray(instance, reflection, f);
+          } else if (f.repeated) {
+            int size = reflection->FieldSize(instance, f.descriptor);
             Local<Array> array = Nan::New<Array>(size);
             for (int j = 0; j < size; j++) {
-              array->Set(j, ToJs(instance, reflection, field, child_type, j));
+              array->Set(j, ToJs(instance, reflection, f, j, context));
             }
             value = array;
           } else {
-            value = ToJs(instance, reflection, field, child_type, -1);
+            value = ToJs(instance, reflection, f, -1, context);
+          }
+
+          properties->Set(i, value);
+        }
+
+        return NewObject(properties, context);
+      }
+
+      // wire -> JS
+
+      enum ParseResult {
+        PARSE_OK,
+        PARSE_MALFORMED,
+        // valid, but needs merge semantics the direct parser doesn't do
+        PARSE_FALLBACK
+      };
+
+      // Decodes fields from the wire directly into "properties" (in
+      // descriptor order, as consumed by the constructor) without building
+      // an intermediate Message.  Stops at the end of input/limit, or at
+      // an END_GROUP tag which must then close "group_number".
+      ParseResult ParseFields(CodedInputStream* input,
+                              int group_number,
+                              const ParseContext& context,
+                              Local<Array> properties) const {
+        // contents of the TypedArrays being read, by field index
+        vector<std::pair<int, string> > typed;
+
+        uint32 tag;
+        while ((tag = input->ReadTag()) != 0) {
+          WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+          int number = WireFormatLite::GetTagFieldNumber(tag);
+          if (wire_type == WireFormatLite::WIRETYPE_END_GROUP) {
+            if (number != group_number) return PARSE_MALFORMED;
+            SetTypedArrays(typed, properties);
+            return PARSE_OK;
+          }
+
+          const Field* f = FieldByNumber(number);
+          if (f && context.mask && !context.mask->include[f->index]) {
+            f = NULL;  // not asked for
+          }
+          bool packed = f && f->packable &&
+            wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+          if (!f || (!packed && wire_type != f->wire_type)) {
+            // unknown field, or a known one with an unexpected encoding
+            if (!WireFormatLite::SkipField(input, tag)) return PARSE_MALFORMED;
+            continue;
+          }
+
+          if (context.typed_arrays && f->typed) {
+            size_t i = 0;
+            while (i < typed.size() && typed[i].first != f->index) i++;
+            if (i == typed.size()) typed.push_back(std::make_pair(f->index, string()));
+            if (!ReadTypedElements(input, *f, packed, &typed[i].second))
+              return PARSE_MALFORMED;
+            continue;
+          }
+
+          Local<Array> array;
+          if (f->repeated) {
+            Local<Value> existing = properties->Get(f->index);
+            if (existing->IsArray()) {
+              array = existing.As<Array>();
+            } else {
+              array = Nan::New<Array>();
+              properties->Set(f->index, array);
+            }
+          }
+
+          if (packed) {
+            uint32 length;
+            if (!input->ReadVarint32(&length)) return PARSE_MALFORMED;
+            CodedInputStream::Limit limit = input->PushLimit(length);
+            while (input->BytesUntilLimit() > 0) {
+              Local<Value> value;
+              if (!f->read(input, *f, context, &value)) return PARSE_MALFORMED;
+              if (!value.IsEmpty()) array->Set(array->Length(), value);
+            }
+            input->PopLimit(limit);
+            continue;
+          }
+
+          Local<Value> value;
+          if (f->message) {
+            if (!f->repeated &&
+                !properties->Get(f->index)->IsUndefined()) {
+              // a repeated occurrence of a singular message must be merged
+              return PARSE_FALLBACK;
+            }
+            if (context.lazy && !context.mask && !f->group) {
+              // keep the encoded message for ParseMessage to put behind
+              // an accessor
+              uint32 length;
+              const void* data = "";
+              int available = 0;
+              if (!input->ReadVarint32(&length)) return PARSE_MALFORMED;
+              if (length > 0 &&
+                  (!input->GetDirectBufferPointer(&data, &available) ||
+                   static_cast<uint32>(available) < length)) {
+                return PARSE_MALFORMED;
+              }
+              // required fields are checked now, as a full parse would
+              const Type* child = ChildType(*f);
+              if (child->has_required_) {
+                CodedInputStream nested(static_cast<const uint8*>(data), length);
+                if (!child->CheckRequired(&nested, 0)) return PARSE_MALFORMED;
+              }
+              value = length ? context.Slice(data, length) :
+                Nan::NewBuffer(0).ToLocalChecked().As<Value>();
+              input->Skip(length);
+            } else {
+              ParseResult result = context.mask ?
+                ParseChild(input, *f, context.Narrow(f->index), &value) :
+                ParseChild(input, *f, context, &value);
+              if (result != PARSE_OK) return result;
+            }
+          } else if (!f->read(input, *f, context, &value)) {
+            return PARSE_MALFORMED;
+          }
+
+          if (value.IsEmpty()) continue;
+          if (f->repeated) {
+            array->Set(array->Length(), value);
+          } else {
+            properties->Set(f->index, value);
+          }
+        }
+        if (group_number != 0) return PARSE_MALFORMED;
+        SetTypedArrays(typed, properties);
+        return PARSE_OK;
+      }
+
+      // Appends one element, or a packed run of them, to "elements".
+      static bool ReadTypedElements(CodedInputStream* input, const Field& f,
+                                    bool packed, string* elements) {
+        if (!packed) return f.read_typed(input, elements);
+
+        uint32 length;
+        if (!input->ReadVarint32(&length)) return false;
+        const void* data;
+        int available;
+        if (length > 0 && input->GetDirectBufferPointer(&data, &available) &&
+            static_cast<uint32>(available) >= length) {
+          const uint8* begin = static_cast<const uint8*>(data);
+          const uint8* end = begin + length;
+          if (f.wire_type == WireFormatLite::WIRETYPE_VARINT) {
+            // all varint kinds are 32 bits wide
+            int count = CountVarints(begin, end);
+            size_t old_size = elements->size();
+            elements->resize(old_size + count * sizeof(uint32));
+            uint32* values = reinterpret_cast<uint32*>(&(*elements)[old_size]);
+            if (ReadVarint32Array(begin, end, count, values) != end)
+              return false;
+            if (f.descriptor->type() == FieldDescriptor::TYPE_SINT32)
+              ZigZagDecode32Array(values, count);
+            return input->Skip(length);
+          }
+#if defined(PROTOBUF_LITTLE_ENDIAN)
+          // fixed-width elements are on the wire as they are in memory
+          if (length % f.typed_size == 0) {
+            elements->append(reinterpret_cast<const char*>(begin), length);
+            return input->Skip(length);
+          }
+#endif
+        }
+        CodedInputStream::Limit limit = input->PushLimit(length);
+        while (input->BytesUntilLimit() > 0) {
+          if (!f.read_typed(input, elements)) return false;
+        }
+        input->PopLimit(limit);
+        return true;
+      }
+
+      void SetTypedArrays(const vector<std::pair<int, string> >& typed,
+                          Local<Array> properties) const {
+        for (size_t i = 0; i < typed.size(); i++) {
+          properties->Set(typed[i].first,
+                          NewTypedArray(fields_[typed[i].first], typed[i].second.data(),
+                                        typed[i].second.size()));
+        }
+      }
+
+      // Parses the sub-message or group of "f" that follows its tag.
+      ParseResult ParseChild(CodedInputStream* input,
+                             const Field& f,
+                             const ParseContext& context,
+                             Local<Value>* value) const {
+        Local<Object> object;
+        ParseResult result;
+        if (!input->IncrementRecursionDepth()) return PARSE_MALFORMED;
+        if (f.group) {
+          result = ChildType(f)->ParseMessage(input, f.number, context, &object);
+        } else {
+          uint32 length;
+          if (!input->ReadVarint32(&length)) return PARSE_MALFORMED;
+          CodedInputStream::Limit limit = input->PushLimit(length);
+          result = ChildType(f)->ParseMessage(input, 0, context, &object);
+          if (result == PARSE_OK && !input->ConsumedEntireMessage())
+            result = PARSE_MALFORMED;
+          input->PopLimit(limit);
+        }
+        input->DecrementRecursionDepth();
+        *value = object;
+        return result;
+      }
+
+      static bool HasRequiredFields(const Descriptor* descriptor,
+                                    std::set<const Descriptor*>* visited) {
+        if (!visited->insert(descriptor).second) return false;
+        for (int i = 0; i < descriptor->field_count(); i++) {
+          const FieldDescriptor* field = descriptor->field(i);
+          if (field->is_required()) return true;
+          if (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE &&
+              HasRequiredFields(field->message_type(), visited)) return true;
+        }
+        return false;
+      }
+
+      // Scans the encoded message at "input", up to its limit or to the
+      // END_GROUP tag closing "group_number", for the required fields a
+      // full parse would insist on, including those of nested messages.
+      // Returns false if one is missing or the message is malformed.
+      bool CheckRequired(CodedInputStream* input, int group_number) const {
+        vector<bool> seen(descriptor_->field_count(), false);
+        bool closed = false;
+        uint32 tag;
+        while ((tag = input->ReadTag()) != 0) {
+          WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+          int number = WireFormatLite::GetTagFieldNumber(tag);
+          if (wire_type == WireFormatLite::WIRETYPE_END_GROUP) {
+            if (number != group_number) return false;
+            closed = true;
+            break;
+          }
+
+          const Field* f = FieldByNumber(number);
+          bool packed = f && f->packable &&
+            wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+          if (!f || (!packed && wire_type != f->wire_type)) {
+            if (!WireFormatLite::SkipField(input, tag)) return false;
+            continue;
+          }
+          seen[f->index] = true;
+          if (!f->message || !ChildType(*f)->has_required_) {
+            if (!WireFormatLite::SkipField(input, tag)) return false;
+            continue;
+          }
+
+          bool complete;
+          if (!input->IncrementRecursionDepth()) return false;
+          if (f->group) {
+            complete = ChildType(*f)->CheckRequired(input, f->number);
+          } else {
+            uint32 length;
+            if (!input->ReadVarint32(&length)) return false;
+            CodedInputStream::Limit limit = input->PushLimit(length);
+            complete = ChildType(*f)->CheckRequired(input, 0);
+            input->PopLimit(limit);
           }
+          input->DecrementRecursionDepth();
+          if (!complete) return false;
+        }
+        // only a message can end where its input does
+        if (!closed && (group_number != 0 || !input->ConsumedEntireMessage()))
+          return false;
+
+        for (size_t i = 0; i < required_.size(); i++) {
+          if (!seen[required_[i]]) return false;
+        }
+        return true;
+      }
+
+      ParseResult ParseMessage(CodedInputStream* input,
+                               int group_number,
+                               const ParseContext& context,
+                               Local<Object>* result) const {
+        Nan::EscapableHandleScope scope;
+
+        Local<Array> properties = Nan::New<Array>(descriptor_->field_count());
+        ParseResult status = ParseFields(input, group_number, context, properties);
+        if (status != PARSE_OK) return status;
+
+        // with a mask, required fields may well not have been asked for
+        for (size_t i = 0; !context.mask && i < required_.size(); i++) {
+          if (properties->Get(required_[i])->IsUndefined()) return PARSE_MALFORMED;
+        }
+
+        Local<Object> object = NewObject(properties, context);
+        if (context.lazy) DefineLazyFields(object, properties, context);
+        *result = scope.Escape(object);
+        return PARSE_OK;
+      }
+
+      // Replaces the encoded sub-messages ParseFields left in "object" with
+      // accessors that parse them on first use.  Until then serialize()
+      // writes the encoded bytes back as they are.
+      void DefineLazyFields(Local<Object> object,
+                            Local<Array> properties,
+                            const ParseContext& context) const {
+        Local<Object> helper = Nan::New(LazyHelper);
+        Local<Function> define =
+          helper->Get(Nan::New<String>("define").ToLocalChecked()).As<Function>();
+        Local<Value> options = context.call_options.IsEmpty() ?
+          Nan::Undefined().As<Value>() : context.call_options;
+        for (int i = 0; i < descriptor_->field_count(); i++) {
+          const Field& f = fields_[i];
+          if (!f.message || f.group) continue;
+          Local<Value> value = properties->Get(i);
+          if (value->IsUndefined()) continue;
+          Local<Value> parse = ChildType(f)->Constructor()->Get(
+            Nan::New<String>(f.repeated ? "parseMany" : "parse").ToLocalChecked());
+          Local<Value> argv[] = {
+            object, Nan::New(f.name), value, parse, options
+          };
+          define->Call(helper, 5, argv);
+        }
+      }
+
+      ParseResult ParseWire(const char* data, size_t length,
+                            const ParseContext& context,
+                            Local<Object>* result) const {
+        CodedInputStream input(reinterpret_cast<const uint8*>(data), length);
+        ParseResult status = ParseMessage(&input, 0, context, result);
+        if (status == PARSE_OK && !input.ConsumedEntireMessage())
+          status = PARSE_MALFORMED;
+        return status;
+      }
+
+      // Parses one message, falling back to a DynamicMessage for input the
+      // direct parser can't handle.  The caller owns "*scratch", which is
+      // created on first use and can be reused across calls since
+      // ParseFromArray() clears it.  Zero-copy only applies to the direct
+      // parser; fallback parses copy.
+      bool ParseBuffer(const char* data, int length,
+                       const ParseContext& context,
+                       Message** scratch, Local<Object>* result) const {
+        switch (ParseWire(data, length, context, result)) {
+        case PARSE_OK:
+          return true;
+        case PARSE_MALFORMED:
+          return false;
+        case PARSE_FALLBACK:
+          break;
+        }
+
+        return ParseScratch(data, length, context, scratch, result);
+      }
+
+      // Parses through a scratch Message, which for synchronous calls comes
+      // from the schema's arena when it has one and from the pool
+      // otherwise.  The caller hands it back with ReleaseScratch().
+      bool ParseScratch(const void* data, int length,
+                        const ParseContext& context,
+                        Message** scratch, Local<Object>* result) const {
+        {
+          DynamicMessageArena::Scope scope(schema_->arena_);
+          if (!*scratch) {
+            if (schema_->arena_) {
+              *scratch = NewMessage();
+              schema_->arena_scratch_++;
+            } else {
+              *scratch = AcquireMessage();
+            }
+          }
+          if (!(*scratch)->ParseFromArray(data, length)) return false;
+        }
+        // outside the scope: ToJs can run JS that parses again
+        *result = ToJs(**scratch, context);
+        return true;
+      }
+
+      // The schema's parse options, overridden by those of the call.  A
+      // mask the Type doesn't own comes with "*mask_owner", which has to
+      // be kept alive for as long as the options are used.
+      const char* ParseOptionsOf(Local<Value> options, ParseOptions* result,
+                                 Local<Object>* mask_owner = NULL) const {
+        *result = schema_->parse_options_;
+        const char* error = ReadParseOptions(options, result);
+        if (error) return error;
+
+        // { fields: ['path.to.field', ...] } or { fields: T.mask([...]) }
+        Local<Value> fields = OptionValue(options, "fields");
+        if (!fields->IsUndefined()) {
+          Local<Object> owner;
+          result->mask = GetMask(fields, &owner);
+          if (!result->mask) return E_FIELDS;
+          if (mask_owner) *mask_owner = owner;
+        }
+        return NULL;
+      }
+
+      // The mask for a "fields" option, or NULL if it isn't a Mask of this
+      // Type or a list of paths to its fields.  Lists are compiled on each
+      // call; the masks of the first few distinct ones are kept by the
+      // Type, later ones are wrapped in a Mask that "*owner" keeps alive.
+      const FieldMask* GetMask(Local<Value> fields, Local<Object>* owner) const {
+        static const size_t kMaxCachedMasks = 16;
+
+        if (Nan::New(MaskTemplate)->HasInstance(fields)) {
+          const Mask* mask = Unwrap<Mask>(fields.As<Object>());
+          if (mask->type_ != this) return NULL;
+          *owner = fields.As<Object>();
+          return mask->mask_;
+        }
+
+        vector<string> paths;
+        string key;
+        if (!ReadPaths(fields, &paths, &key)) return NULL;
+        map<string, FieldMask*>::iterator it = masks_.find(key);
+        if (it != masks_.end()) return it->second;
+
+        FieldMask* mask = CompileMask(paths);
+        if (!mask) return NULL;
+        if (masks_.size() < kMaxCachedMasks) {
+          masks_[key] = mask;
+        } else {
+          *owner = WrapMask(mask);
+        }
+        return mask;
+      }
+
+      // The paths of an array of them, and "key", all of them joined.
+      static bool ReadPaths(Local<Value> fields, vector<string>* paths, string* key) {
+        if (!fields->IsArray()) return false;
+        Local<Array> array = fields.As<Array>();
+        for (uint32 i = 0; i < array->Length(); i++) {
+          Nan::Utf8String path(array->Get(i));
+          paths->push_back(string(*path, path.length()));
+          *key += paths->back();
+          *key += '\n';
+        }
+        return true;
+      }
+
+      // A new mask for "paths", or NULL if one of them doesn't name a
+      // field.
+      FieldMask* CompileMask(const vector<string>& paths) const {
+        FieldMask* mask = new FieldMask(descriptor_->field_count());
+        for (size_t i = 0; i < paths.size(); i++) {
+          if (!AddToMask(mask, paths[i])) {
+            delete mask;
+            return NULL;
+          }
+        }
+        return mask;
+      }
+
+      // Adds "path", a dotted list of field names relative to this Type,
+      // to "mask".
+      bool AddToMask(FieldMask* mask, const string& path) const {
+        string::size_type dot = path.find('.');
+        string name = path.substr(0, dot);
+        const Field* field = FieldByName(name);
+        if (!field) return false;
+
+        int i = field->index;
+        if (dot == string::npos) {
+          // all of it
+          delete mask->children[i];
+          mask->children[i] = NULL;
+          mask->include[i] = true;
+          return true;
+        }
+
+        const Field& f = fields_[i];
+        if (!f.message) return false;
+        const Type* child = ChildType(f);
+        if (mask->include[i] && !mask->children[i]) {
+          // already all of it; just check the path
+          FieldMask check(child->descriptor_->field_count());
+          return child->AddToMask(&check, path.substr(dot + 1));
+        }
+        if (!mask->children[i])
+          mask->children[i] = new FieldMask(child->descriptor_->field_count());
+        mask->include[i] = true;
+        return child->AddToMask(mask->children[i], path.substr(dot + 1));
+      }
+
+      // The result of mask(), a list of field paths compiled once for
+      // the "fields" option.
+      class Mask : public Nan::ObjectWrap {
+      public:
+        Mask(const Type* type, FieldMask* mask, Local<Object> self)
+          : type_(type), mask_(mask) {
+          // managed mask->type link
+          self->SetInternalField(1, const_cast<Type*>(type)->handle());
+          Wrap(self);
+        }
+
+        virtual ~Mask() {
+          delete mask_;
+        }
+
+        const Type* type_;
+        FieldMask* mask_;
+      };
+
+      // Hands "mask" over to a new Mask.
+      Local<Object> WrapMask(FieldMask* mask) const {
+        Local<FunctionTemplate> maskTemplate = Nan::New(MaskTemplate);
+        Local<Object> self = Nan::NewInstance(maskTemplate->GetFunction()).ToLocalChecked();
+        new Mask(this, mask, self);
+        return self;
+      }
+
+      // mask(['path.to.field', ...]) -> a mask to pass as the "fields"
+      // option of this Type's parses
+      static NAN_METHOD(NewMask) {
+        Type *type = Unwrap<Type>(info.This());
+        vector<string> paths;
+        string key;
+        FieldMask* mask = NULL;
+        if (type->ReadPaths(info[0], &paths, &key)) mask = type->CompileMask(paths);
+        if (!mask) {
+          return Nan::ThrowTypeError(E_FIELDS);
+        }
+        info.GetReturnValue().Set(type->WrapMask(mask));
+      }
+
+      // The arena is only reset once no parse, including ones re-entered
+      // from JS during ToJs, holds a scratch Message in it.
+      void ReleaseScratch(Message* scratch) const {
+        if (!schema_->arena_) return ReleaseMessage(scratch);
+        if (!scratch) return;
+        delete scratch;
+        if (--schema_->arena_scratch_ == 0) schema_->arena_->Reset();
+      }
+
+      static NAN_METHOD(Parse) {
+        if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
+        }
+
+        Local<Object> buffer_obj = info[0]->ToObject();
+
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        const char* error = type->ParseOptionsOf(info[1], &options);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+
+        Message* scratch = NULL;
+        Local<Object> result;
+        bool success = type->ParseBuffer(node::Buffer::Data(buffer_obj),
+                                         node::Buffer::Length(buffer_obj),
+                                         ParseContext(options, buffer_obj, info[1]),
+                                         &scratch, &result);
+        type->ReleaseScratch(scratch);
+
+        if (!success) {
+          return Nan::ThrowError("Malformed message");
+        }
+
+        info.GetReturnValue().Set(result);
+      }
+
+      // parseMany([buffer, ...]) -> [message, ...], amortizing the call
+      // overhead and the fallback Message over the whole batch.
+      static NAN_METHOD(ParseMany) {
+        if ((info.Length() < 1) || (!info[0]->IsArray())) {
+          return Nan::ThrowTypeError(E_NO_ARRAY);
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        const char* error = type->ParseOptionsOf(info[1], &options);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+
+        Local<Array> buffers = info[0].As<Array>();
+        int length = buffers->Length();
+        Local<Array> results = Nan::New<Array>(length);
+
+        Message* scratch = NULL;
+        for (int i = 0; !error && i < length; i++) {
+          Local<Value> buffer = buffers->Get(i);
+          if (!node::Buffer::HasInstance(buffer)) {
+            error = "Argument should be an array of buffers";
+            break;
+          }
+
+          Local<Object> result;
+          if (!type->ParseBuffer(node::Buffer::Data(buffer),
+                                 node::Buffer::Length(buffer),
+                                 ParseContext(options, buffer.As<Object>(), info[1]),
+                                 &scratch, &result)) {
+            error = "Malformed message";
+            break;
+          }
+          results->Set(i, result);
+        }
+        type->ReleaseScratch(scratch);
+
+        if (error) {
+          return Nan::ThrowError(error);
+        }
+
+        info.GetReturnValue().Set(results);
+      }
+
+      // Parses the varint length-prefixed message at the current position
+      // of "input".
+      bool ParseDelimitedMessage(CodedInputStream* input,
+                                 const ParseContext& context,
+                                 Message** scratch,
+                                 Local<Object>* result) const {
+        uint32 size;
+        if (!input->ReadVarint32(&size)) return false;
+
+        const void* data = "";
+        int available = 0;
+        if (size > 0 &&
+            (!input->GetDirectBufferPointer(&data, &available) ||
+             static_cast<uint32>(available) < size)) {
+          return false;
+        }
+
+        CodedInputStream::Limit limit = input->PushLimit(size);
+        ParseResult status = ParseMessage(input, 0, context, result);
+        if (status == PARSE_OK && !input->ConsumedEntireMessage())
+          status = PARSE_MALFORMED;
+        if (status == PARSE_FALLBACK) {
+          if (!ParseScratch(data, size, context, scratch, result)) return false;
+          input->Skip(input->BytesUntilLimit());
+          status = PARSE_OK;
+        }
+        input->PopLimit(limit);
+        return status == PARSE_OK;
+      }
+
+      // parseDelimited(buffer) -> [message, ...] for a buffer holding
+      // consecutive varint length-prefixed messages.
+      static NAN_METHOD(ParseDelimited) {
+        if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
+        }
+
+        Local<Object> buffer_obj = info[0]->ToObject();
+        size_t length = node::Buffer::Length(buffer_obj);
+        if (length > INT_MAX) {
+          return Nan::ThrowRangeError("Buffer too large");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        const char* error = type->ParseOptionsOf(info[1], &options);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+
+        ParseContext context(options, buffer_obj, info[1]);
+        CodedInputStream input(reinterpret_cast<const uint8*>(node::Buffer::Data(buffer_obj)),
+                               length);
+        // the default 64MB limit is meant for single messages
+        input.SetTotalBytesLimit(INT_MAX, -1);
+        input.PushLimit(length);
+
+        Local<Array> results = Nan::New<Array>();
+        Message* scratch = NULL;
+        bool success = true;
+        while (success && input.BytesUntilLimit() > 0) {
+          Local<Object> result;
+          success = type->ParseDelimitedMessage(&input, context, &scratch, &result);
+          if (success) results->Set(results->Length(), result);
+        }
+        type->ReleaseScratch(scratch);
+
+        if (!success) {
+          return Nan::ThrowError("Malformed message");
+        }
+
+        info.GetReturnValue().Set(results);
+      }
+
+      // Reads the varint length prefix of a delimited message.  Returns the
+      // number of bytes it takes, 0 if "data" ends inside it or -1 if it is
+      // malformed.
+      static int ReadLengthPrefix(const char* data, size_t length, uint32* size) {
+        static const int kMaxLengthPrefixBytes = 5;
+
+        uint64 result = 0;
+        for (int i = 0; i < kMaxLengthPrefixBytes; i++) {
+          if (static_cast<size_t>(i) >= length) return 0;
+          uint8 b = static_cast<uint8>(data[i]);
+          result |= static_cast<uint64>(b & 0x7F) << (7 * i);
+          if (!(b & 0x80)) {
+            if (result > INT_MAX) return -1;
+            *size = static_cast<uint32>(result);
+            return i + 1;
+          }
+        }
+        return -1;
+      }
+
+      // Scans the message in "input" for the field at path[depth], and
+      // through sub-messages for the rest of the path, without building
+      // anything else.  Like a merging parse, the last occurrence wins;
+      // repeated fields at the end of the path collect all of them.
+      bool PeekField(CodedInputStream* input,
+                     const vector<const Field*>& path,
+                     size_t depth,
+                     const ParseContext& context,
+                     Local<Value>* result) const {
+        const Field& f = *path[depth];
+        bool last = depth + 1 == path.size();
+
+        uint32 tag;
+        while ((tag = input->ReadTag()) != 0) {
+          WireFormatLite::WireType wire_type = WireFormatLite::GetTagWireType(tag);
+          bool packed = f.packable &&
+            wire_type == WireFormatLite::WIRETYPE_LENGTH_DELIMITED;
+          if (WireFormatLite::GetTagFieldNumber(tag) != f.number ||
+              (!packed && wire_type != f.wire_type)) {
+            if (wire_type == WireFormatLite::WIRETYPE_END_GROUP ||
+                !WireFormatLite::SkipField(input, tag)) return false;
+            continue;
+          }
+
+          if (f.repeated && last && !(*result)->IsArray()) {
+            *result = Nan::New<Array>();
+          }
+
+          if (packed) {
+            uint32 length;
+            if (!input->ReadVarint32(&length)) return false;
+            CodedInputStream::Limit limit = input->PushLimit(length);
+            Local<Array> array = result->As<Array>();
+            while (input->BytesUntilLimit() > 0) {
+              Local<Value> value;
+              if (!f.read(input, f, context, &value)) return false;
+              if (!value.IsEmpty()) array->Set(array->Length(), value);
+            }
+            input->PopLimit(limit);
+            continue;
+          }
+
+          Local<Value> value;
+          if (f.message) {
+            uint32 length;
+            const void* data = "";
+            int available = 0;
+            if (!input->ReadVarint32(&length)) return false;
+            if (length > 0 &&
+                (!input->GetDirectBufferPointer(&data, &available) ||
+                 static_cast<uint32>(available) < length)) {
+              return false;
+            }
+            if (last) {
+              // still encoded
+              value = length ? context.Slice(data, length) :
+                Nan::NewBuffer(0).ToLocalChecked().As<Value>();
+              input->Skip(length);
+            } else {
+              CodedInputStream::Limit limit = input->PushLimit(length);
+              if (!input->IncrementRecursionDepth()) return false;
+              bool success = ChildType(f)->PeekField(input, path, depth + 1, context, result);
+              input->DecrementRecursionDepth();
+              if (!success || !input->ConsumedEntireMessage()) return false;
+              input->PopLimit(limit);
+              continue;
+            }
+          } else if (!f.read(input, f, context, &value)) {
+            return false;
+          }
+
+          if (value.IsEmpty()) continue;
+          if (f.repeated && last) {
+            Local<Array> array = result->As<Array>();
+            array->Set(array->Length(), value);
+          } else {
+            *result = value;
+          }
+        }
+        return true;
+      }
+
+      // peek(buffer, 'path.to.field', options) -> the field's value, or
+      // undefined if absent, read straight off the wire.  Bytes fields and
+      // sub-messages are returned as slices of the buffer, still encoded
+      // in the latter case.  The path can end at a repeated field but not
+      // go through one, as it would have to pick an element.
+      static NAN_METHOD(Peek) {
+        if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        const char* error = type->ParseOptionsOf(info[2], &options);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+        options.zero_copy = true;
+
+        // resolve the path up front, so that a wrong one fails even when
+        // the field is absent
+        vector<const Field*> path;
+        const Type* current = type;
+        string rest = *Nan::Utf8String(info[1]);
+        for (;;) {
+          string::size_type dot = rest.find('.');
+          const Field* f = current ? current->FieldByName(rest.substr(0, dot)) : NULL;
+          if (!f || f->group) {
+            return Nan::ThrowTypeError("Not a path to a field outside of groups");
+          }
+          path.push_back(f);
+          if (dot == string::npos) break;
+          if (f->repeated) {
+            return Nan::ThrowTypeError("Not a path through singular fields");
+          }
+          current = f->message ? current->ChildType(*f) : NULL;
+          rest = rest.substr(dot + 1);
+        }
+
+        Local<Object> buffer_obj = info[0]->ToObject();
+        CodedInputStream input(reinterpret_cast<const uint8*>(node::Buffer::Data(buffer_obj)),
+                               node::Buffer::Length(buffer_obj));
+        Local<Value> result = Nan::Undefined();
+        if (!type->PeekField(&input, path, 0, ParseContext(options, buffer_obj), &result)) {
+          return Nan::ThrowError("Malformed message");
+        }
+        info.GetReturnValue().Set(result);
+      }
+
+      // Incremental decoder for a stream of delimited messages: push()
+      // takes chunks as they arrive and returns the messages they complete.
+      // Complete messages are parsed in place; only the unfinished tail of
+      // a chunk is copied.
+      class Decoder : public Nan::ObjectWrap {
+      public:
+        Decoder(const Type* type, const ParseOptions& options, Local<Object> self)
+          : type_(type), options_(options) {
+          // chunks don't outlive push(), so views of them can't be handed out
+          options_.zero_copy = false;
+          // managed decoder->type link
+          self->SetInternalField(1, const_cast<Type*>(type)->handle());
+          Wrap(self);
+        }
+
+        static NAN_METHOD(Push) {
+          if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+            return Nan::ThrowTypeError("Argument should be a buffer");
+          }
+
+          Decoder* decoder = Unwrap<Decoder>(info.This());
+          Local<Object> buffer_obj = info[0]->ToObject();
+          Local<Array> results = Nan::New<Array>();
+          if (!decoder->Feed(node::Buffer::Data(buffer_obj),
+                             node::Buffer::Length(buffer_obj),
+                             results)) {
+            decoder->pending_.clear();
+            return Nan::ThrowError("Malformed message");
+          }
+
+          info.GetReturnValue().Set(results);
+        }
+
+        // end() throws if the stream stopped in the middle of a message.
+        static NAN_METHOD(End) {
+          Decoder* decoder = Unwrap<Decoder>(info.This());
+          bool truncated = !decoder->pending_.empty();
+          decoder->pending_.clear();
+          if (truncated) {
+            return Nan::ThrowError("Truncated message");
+          }
+        }
+
+      private:
+        bool Feed(const char* data, size_t length, Local<Array> results) {
+          Message* scratch = NULL;
+          bool success = Feed(data, length, ParseContext(options_), &scratch, results);
+          type_->ReleaseScratch(scratch);
+          return success;
+        }
+
+        bool Feed(const char* data, size_t length, const ParseContext& context,
+                  Message** scratch, Local<Array> results) {
+          uint32 size;
+          int header;
+          Local<Object> result;
+
+          if (!pending_.empty()) {
+            // complete the pending message with as few bytes as possible
+            while ((header = ReadLengthPrefix(pending_.data(), pending_.size(), &size)) == 0) {
+              if (length == 0) return true;
+              pending_.push_back(*data++);
+              length--;
+            }
+            if (header < 0) return false;
+
+            size_t needed = header + size - pending_.size();
+            size_t taken = std::min(needed, length);
+            pending_.append(data, taken);
+            data += taken;
+            length -= taken;
+            if (taken < needed) return true;
+
+            if (!type_->ParseBuffer(pending_.data() + header, size, context, scratch, &result))
+              return false;
+            results->Set(results->Length(), result);
+            pending_.clear();
+          }
+
+          while (length > 0) {
+            header = ReadLengthPrefix(data, length, &size);
+            if (header < 0) return false;
+            if (header == 0 || length - header < size) break;
+
+            if (!type_->ParseBuffer(data + header, size, context, scratch, &result))
+              return false;
+            results->Set(results->Length(), result);
+            data += header + size;
+            length -= header + size;
+          }
+
+          pending_.assign(data, length);
+          return true;
+        }
+
+        const Type* type_;
+        ParseOptions options_;
+        string pending_;
+      };
+
+      static NAN_METHOD(NewDecoder) {
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        Local<Object> mask_owner;
+        const char* error = type->ParseOptionsOf(info[0], &options, &mask_owner);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+
+        Local<FunctionTemplate> decoderTemplate = Nan::New(DecoderTemplate);
+        Local<Object> self = Nan::NewInstance(decoderTemplate->GetFunction()).ToLocalChecked();
+        new Decoder(type, options, self);
+        if (!mask_owner.IsEmpty()) self->SetInternalField(2, mask_owner);
+        info.GetReturnValue().Set(self);
+      }
+
+      // JS -> Message
+
+      const char* ToProto(Message* instance,
+                          const Field& f,
+                          Local<Value> value) const {
+        Nan::HandleScope scope;
+
+        const Reflection* reflection = instance->GetReflection();
+        if (f.message) {
+          if (!value->IsObject()) {
+            return E_NO_OBJECT;
+          }
+          Message* message = f.repeated ?
+            reflection->AddMessage(instance, f.descriptor) :
+            reflection->MutableMessage(instance, f.descriptor);
+          if (IsEncoded(f, value)) {
+            return message->ParseFromArray(node::Buffer::Data(value),
+                                           node::Buffer::Length(value)) ?
+              NULL : "Malformed message";
+          }
+          return ChildType(f)->ToProto(message, value.As<Object>());
+        }
+        return f.set(instance, reflection, f, value);
+      }
+
+      // A Buffer given for a message field holds the encoded message, as
+      // left by lazy parses; it is written out as it is.
+      static bool IsEncoded(const Field& f, Local<Value> value) {
+        return !f.group && node::Buffer::HasInstance(value);
+      }
+
+      // Appends the contents of a TypedArray given for "f", copying them
+      // straight into the field's storage where the Message exposes it.
+      static void AddTypedElements(Message* instance, const Field& f,
+                                   const char* elements, int length) {
+        const Reflection* reflection = instance->GetReflection();
+        void* raw = reflection->MutableRawRepeatedPrimitive(instance, f.descriptor);
+        if (raw) {
+          switch (f.typed) {
+          case TYPED_INT32: return AddRawElements<int32>(raw, elements, length);
+          case TYPED_UINT32: return AddRawElements<uint32>(raw, elements, length);
+          case TYPED_FLOAT32: return AddRawElements<float>(raw, elements, length);
+          default: return AddRawElements<double>(raw, elements, length);
+          }
+        }
+
+        for (int j = 0; j < length; j++) {
+          Scalar scalar = TypedElement(f, elements, j);
+          switch (f.typed) {
+          case TYPED_INT32:
+            reflection->AddInt32(instance, f.descriptor, scalar.i32);
+            break;
+          case TYPED_UINT32:
+            reflection->AddUInt32(instance, f.descriptor, scalar.u32);
+            break;
+          case TYPED_FLOAT32:
+            reflection->AddFloat(instance, f.descriptor, scalar.f);
+            break;
+          default:
+            reflection->AddDouble(instance, f.descriptor, scalar.d);
+            break;
+          }
+        }
+      }
+
+      Local<Array> ToArray(Local<Object> src) const {
+        Local<Object> handle = const_cast<Type *>(this)->handle();
+        Local<Function> to_array = handle->GetInternalField(3).As<Function>();
+        return to_array->Call(src, 0, NULL).As<Array>();
+      }
+
+      const char* ToProto(Message* instance, Local<Object> src) const {
+        Local<Array> properties = ToArray(src);
+
+        const char* error = NULL;
+        for (int i = 0; !error && i < descriptor_->field_count(); i++) {
+          Local<Value> value = properties->Get(i);
+          if (value->IsUndefined() ||
+              value->IsNull()) continue;
+
+          const Field& f = fields_[i];
+          if (f.repeated) {
+            const char* elements;
+            int length;
+            if (!value->IsArray() && GetTypedElements(f, value, &elements, &length)) {
+              if (length > 0) AddTypedElements(instance, f, elements, length);
+              continue;
+            }
+            if(!value->IsArray()) {
+              error = E_NO_ARRAY;
+              continue;
+            }
+
+            Local<Array> array = value.As<Array>();
+            length = array->Length();
+
+            for (int j = 0; !error && j < length; j++) {
+              error = ToProto(instance, f, array->Get(j));
+            }
+          } else {
+            error = ToProto(instance, f, value);
+          }
+        }
+        return error;
+      }
+
+      // JS -> wire
+
+      // Scratch space shared by the two passes of the direct serializer.
+      // The size pass records, in visit order, the properties of every
+      // message and the length of every nested message, packed run and
+      // string; the write pass consumes them in the same order.
+      struct SerializeScratch {
+        vector<Local<Array> > objects;
+        vector<int> sizes;
+        size_t next_object;
+        size_t next_size;
+
+        // For serializev(): string and bytes values given as Buffers of at
+        // least "gather" bytes are left out of the output and referenced
+        // instead, each recorded with the position it goes to.
+        size_t gather;
+        size_t gathered;  // bytes left out, per the size pass
+        size_t skipped;   // bytes left out so far by the write pass
+        vector<std::pair<uint8*, Local<Object> > > segments;
+
+        SerializeScratch()
+          : next_object(0), next_size(0), gather(0), gathered(0), skipped(0) {}
+
+        bool Gathers(const Field& f, const Scalar& scalar) const {
+          return gather && f.convert == ConvertString && scalar.data &&
+            static_cast<size_t>(scalar.length) >= gather;
+        }
+      };
+
+      // Adds "n" to the running size "*total", failing rather than
+      // overflowing it.
+      static bool AddSize(int64 n, int* total) {
+        if (n > INT_MAX - *total) return false;
+        *total += static_cast<int>(n);
+        return true;
+      }
+
+      // Size pass: computes the encoded size of "src" without touching a
+      // Message, validating it the way ToProto does.
+      const char* ComputeSize(Local<Object> src,
+                              SerializeScratch* scratch,
+                              int* size) const {
+        Local<Array> properties = ToArray(src);
+        scratch->objects.push_back(properties);
+
+        int total = 0;
+        for (size_t k = 0; k < serialize_order_.size(); k++) {
+          const Field& f = fields_[serialize_order_[k]];
+          Local<Value> value = properties->Get(f.index);
+          if (value->IsUndefined() ||
+              value->IsNull()) continue;
+
+          if (!f.repeated) {
+            int value_size;
+            const char* error = ComputeValueSize(f, value, scratch, &value_size);
+            if (error) return error;
+            if (!AddSize(f.tag_size + value_size, &total)) return E_TOO_LARGE;
+            continue;
+          }
+
+          const char* elements;
+          int length;
+          if (!value->IsArray() && GetTypedElements(f, value, &elements, &length)) {
+            // straight from the TypedArray's memory
+            if (length == 0) continue;
+            int data_size = 0;
+            for (int j = 0; j < length; j++) {
+              if (!AddSize(f.size(TypedElement(f, elements, j)), &data_size))
+                return E_TOO_LARGE;
+            }
+            if (f.packed) {
+              scratch->sizes.push_back(data_size);
+              if (!AddSize(static_cast<int64>(f.tag_size) +
+                           CodedOutputStream::VarintSize32(data_size) + data_size,
+                           &total)) return E_TOO_LARGE;
+            } else {
+              if (!AddSize(static_cast<int64>(f.tag_size) * length + data_size,
+                           &total)) return E_TOO_LARGE;
+            }
+            continue;
+          }
+
+          if (!value->IsArray()) {
+            return E_NO_ARRAY;
+          }
+          Local<Array> array = value.As<Array>();
+          length = array->Length();
+          if (length == 0) continue;
+
+          if (f.packed) {
+            size_t slot = scratch->sizes.size();
+            scratch->sizes.push_back(0);
+            int data_size = 0;
+            for (int j = 0; j < length; j++) {
+              int value_size;
+              const char* error =
+                ComputeValueSize(f, array->Get(j), scratch, &value_size);
+              if (error) return error;
+              if (!AddSize(value_size, &data_size)) return E_TOO_LARGE;
+            }
+            scratch->sizes[slot] = data_size;
+            if (!AddSize(static_cast<int64>(f.tag_size) +
+                         CodedOutputStream::VarintSize32(data_size) + data_size,
+                         &total)) return E_TOO_LARGE;
+          } else {
+            for (int j = 0; j < length; j++) {
+              int value_size;
+              const char* error =
+                ComputeValueSize(f, array->Get(j), scratch, &value_size);
+              if (error) return error;
+              if (!AddSize(static_cast<int64>(f.tag_size) + value_size, &total))
+                return E_TOO_LARGE;
+            }
+          }
+        }
+
+        *size = total;
+        return NULL;
+      }
+
+      // Size of one value of "f", without its tag.  Nested messages
+      // record their length for the write pass.
+      const char* ComputeValueSize(const Field& f,
+                                   Local<Value> value,
+                                   SerializeScratch* scratch,
+                                   int* size) const {
+        if (!f.message) {
+          Scalar scalar;
+          const char* error = f.convert(f, value, &scalar);
+          if (error) return error;
+          *size = f.size(scalar);
+          if (f.convert == ConvertString) {
+            // measuring UTF-8 takes a pass over the string; do it once
+            scratch->sizes.push_back(scalar.length);
+            if (scratch->Gathers(f, scalar)) scratch->gathered += scalar.length;
+          }
+          return NULL;
+        }
+
+        if (!value->IsObject()) {
+          return E_NO_OBJECT;
+        }
+        if (f.group) {
+          // the tag size already accounts for the end tag
+          return ChildType(f)->ComputeSize(value.As<Object>(), scratch, size);
+        }
+        if (IsEncoded(f, value)) {
+          size_t length = node::Buffer::Length(value);
+          if (length > INT_MAX / 2) return "Buffer too large";
+          *size = CodedOutputStream::VarintSize32(length) + static_cast<int>(length);
+          return NULL;
+        }
+        size_t slot = scratch->sizes.size();
+        scratch->sizes.push_back(0);
+        int message_size;
+        const char* error =
+          ChildType(f)->ComputeSize(value.As<Object>(), scratch, &message_size);
+        if (error) return error;
+        scratch->sizes[slot] = message_size;
+        *size = 0;
+        if (!AddSize(static_cast<int64>(CodedOutputStream::VarintSize32(message_size)) +
+                     message_size, size)) return E_TOO_LARGE;
+        return NULL;
+      }
+
+      // Write pass: encodes the object recorded next in "scratch" into
+      // [target, end).  Returns NULL if the sizes no longer match because
+      // the object was modified from a getter or valueOf() in between.
+      uint8* WriteTo(SerializeScratch* scratch, uint8* target, uint8* end) const {
+        if (scratch->next_object >= scratch->objects.size()) return NULL;
+        Local<Array> properties = scratch->objects[scratch->next_object++];
+
+        for (size_t k = 0; target && k < serialize_order_.size(); k++) {
+          const Field& f = fields_[serialize_order_[k]];
+          Local<Value> value = properties->Get(f.index);
+          if (value->IsUndefined() ||
+              value->IsNull()) continue;
+
+          if (!f.repeated) {
+            target = WriteValue(f, value, scratch, target, end);
+            continue;
+          }
+
+          const char* elements;
+          int length;
+          if (!value->IsArray() && GetTypedElements(f, value, &elements, &length)) {
+            if (length > 0) target = WriteTypedElements(f, elements, length, scratch, target, end);
+            continue;
+          }
+
+          Local<Array> array = value.As<Array>();
+          length = array->Length();
+          if (length == 0) continue;
+
+          if (f.packed) {
+            if (scratch->next_size >= scratch->sizes.size()) return NULL;
+            int data_size = scratch->sizes[scratch->next_size++];
+            if (end - target < f.tag_size +
+                CodedOutputStream::VarintSize32(data_size) + data_size) return NULL;
+            target = WireFormatLite::WriteTagToArray(f.number,
+                WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+            target = CodedOutputStream::WriteVarint32ToArray(data_size, target);
+            uint8* run = target;
+            for (int j = 0; target && j < length; j++) {
+              Scalar scalar;
+              if (f.convert(f, array->Get(j), &scalar) ||
+                  end - target < f.size(scalar)) return NULL;
+              target = f.write(scalar, target);
+            }
+            // values changed by valueOf() would leave the length prefix wrong
+            if (target != run + data_size) return NULL;
+          } else {
+            for (int j = 0; target && j < length; j++) {
+              target = WriteValue(f, array->Get(j), scratch, target, end);
+            }
+          }
+        }
+        return target;
+      }
+
+      // Writes the contents of a TypedArray given for "f".
+      uint8* WriteTypedElements(const Field& f, const char* elements, int length,
+                                SerializeScratch* scratch,
+                                uint8* target, uint8* end) const {
+        if (!f.packed) {
+          for (int j = 0; j < length; j++) {
+            Scalar scalar = TypedElement(f, elements, j);
+            if (end - target < f.tag_size + f.size(scalar)) return NULL;
+            target = CodedOutputStream::WriteTagToArray(f.tag, target);
+            target = f.write(scalar, target);
+          }
+          return target;
+        }
+
+        if (scratch->next_size >= scratch->sizes.size()) return NULL;
+        int data_size = scratch->sizes[scratch->next_size++];
+        if (end - target < f.tag_size +
+            CodedOutputStream::VarintSize32(data_size) + data_size) return NULL;
+        target = WireFormatLite::WriteTagToArray(f.number,
+            WireFormatLite::WIRETYPE_LENGTH_DELIMITED, target);
+        target = CodedOutputStream::WriteVarint32ToArray(data_size, target);
+#if defined(PROTOBUF_LITTLE_ENDIAN)
+        if (f.wire_type != WireFormatLite::WIRETYPE_VARINT) {
+          // fixed-width elements go on the wire as they are in memory
+          if (data_size != length * f.typed_size) return NULL;
+          memcpy(target, elements, data_size);
+          return target + data_size;
+        }
+#endif
+        uint8* data_end = target + data_size;
+        for (int j = 0; j < length; j++) {
+          Scalar scalar = TypedElement(f, elements, j);
+          if (data_end - target < f.size(scalar)) return NULL;
+          target = f.write(scalar, target);
+        }
+        return target == data_end ? target : NULL;
+      }
+
+      // Writes one value of "f" including its tag.
+      uint8* WriteValue(const Field& f,
+                        Local<Value> value,
+                        SerializeScratch* scratch,
+                        uint8* target,
+                        uint8* end) const {
+        if (!f.message) {
+          Scalar scalar;
+          if (f.convert == ConvertString) {
+            if (scratch->next_size >= scratch->sizes.size()) return NULL;
+            int length = scratch->sizes[scratch->next_size++];
+            if (value->IsString()) {
+              // immutable, so still as long as measured
+              scalar.data = NULL;
+              scalar.string = value.As<String>();
+              scalar.length = length;
+            } else if (ConvertString(f, value, &scalar) || scalar.length != length) {
+              return NULL;
+            }
+          } else if (f.convert(f, value, &scalar)) {
+            return NULL;
+          }
+          if (scratch->Gathers(f, scalar)) {
+            // just the tag and length; the contents are a segment of their own
+            if (end - target < f.tag_size + f.size(scalar) - scalar.length) return NULL;
+            target = CodedOutputStream::WriteTagToArray(f.tag, target);
+            target = CodedOutputStream::WriteVarint32ToArray(scalar.length, target);
+            scratch->segments.push_back(std::make_pair(target, value.As<Object>()));
+            scratch->skipped += scalar.length;
+            return target;
+          }
+          if (end - target < f.tag_size + f.size(scalar)) return NULL;
+          target = CodedOutputStream::WriteTagToArray(f.tag, target);
+          return f.write(scalar, target);
+        }
+
+        if (f.group) {
+          if (end - target < f.tag_size) return NULL;
+          target = CodedOutputStream::WriteTagToArray(f.tag, target);
+          // keep room for the end tag
+          target = ChildType(f)->WriteTo(scratch, target, end - f.tag_size / 2);
+          if (!target) return NULL;
+          return WireFormatLite::WriteTagToArray(f.number,
+              WireFormatLite::WIRETYPE_END_GROUP, target);
+        }
+
+        if (IsEncoded(f, value)) {
+          int length = node::Buffer::Length(value);
+          if (end - target < f.tag_size + CodedOutputStream::VarintSize32(length) + length)
+            return NULL;
+          target = CodedOutputStream::WriteTagToArray(f.tag, target);
+          target = CodedOutputStream::WriteVarint32ToArray(length, target);
+          memcpy(target, node::Buffer::Data(value), length);
+          return target + length;
+        }
+
+        if (scratch->next_size >= scratch->sizes.size()) return NULL;
+        int size = scratch->sizes[scratch->next_size++];
+        if (end - target < f.tag_size + CodedOutputStream::VarintSize32(size) +
+            (scratch->gather ? 0 : size))
+          return NULL;
+        target = CodedOutputStream::WriteTagToArray(f.tag, target);
+        target = CodedOutputStream::WriteVarint32ToArray(size, target);
+        uint8* start = target;
+        size_t skipped = scratch->skipped;
+        target = ChildType(f)->WriteTo(scratch, target, std::min(start + size, end));
+        return (target && target - start + (scratch->skipped - skipped) == static_cast<size_t>(size)) ?
+          target : NULL;
+      }
+
+      // Serializes "src" in two passes over the JS object, writing the
+      // wire format straight into a Buffer without building a Message.
+      static NAN_METHOD(Serialize) {
+        if ((info.Length() < 1) || (!info[0]->IsObject())) {
+          return Nan::ThrowTypeError("Not an object");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        SerializeScratch scratch;
+        int size;
+        const char* error = type->ComputeSize(info[0].As<Object>(), &scratch, &size);
+        if (error) {
+          return Nan::ThrowError(error);
+        }
+
+        Local<Object> result = Nan::NewBuffer(size).ToLocalChecked();
+        uint8* start = reinterpret_cast<uint8*>(node::Buffer::Data(result));
+        if (type->WriteTo(&scratch, start, start + size) != start + size) {
+          return Nan::ThrowError(E_CHANGED);
+        }
+
+        info.GetReturnValue().Set(result);
+      }
+
+      // serializeInto(message, buffer, offset) -> number of bytes written
+      // at buffer[offset], which must have room for all of them.  Nothing
+      // is allocated.
+      static NAN_METHOD(SerializeInto) {
+        if ((info.Length() < 1) || (!info[0]->IsObject())) {
+          return Nan::ThrowTypeError("Not an object");
+        }
+        if ((info.Length() < 2) || (!node::Buffer::HasInstance(info[1]))) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
+        }
+
+        size_t length = node::Buffer::Length(info[1]);
+        double offset = info[2]->IsUndefined() ? 0 : info[2]->NumberValue();
+        if (!(offset >= 0 && offset <= length) || offset != static_cast<size_t>(offset)) {
+          return Nan::ThrowRangeError("Offset out of range");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        SerializeScratch scratch;
+        int size;
+        const char* error = type->ComputeSize(info[0].As<Object>(), &scratch, &size);
+        if (error) {
+          return Nan::ThrowError(error);
+        }
+        if (static_cast<size_t>(size) > length - static_cast<size_t>(offset)) {
+          return Nan::ThrowRangeError("Buffer too small");
+        }
+
+        uint8* start = reinterpret_cast<uint8*>(node::Buffer::Data(info[1])) +
+          static_cast<size_t>(offset);
+        if (type->WriteTo(&scratch, start, start + size) != start + size) {
+          return Nan::ThrowError(E_CHANGED);
+        }
+
+        info.GetReturnValue().Set(size);
+      }
+
+      // byteSize(message) -> length of serialize(message)
+      static NAN_METHOD(ByteSize) {
+        if ((info.Length() < 1) || (!info[0]->IsObject())) {
+          return Nan::ThrowTypeError("Not an object");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        SerializeScratch scratch;
+        int size;
+        const char* error = type->ComputeSize(info[0].As<Object>(), &scratch, &size);
+        if (error) {
+          return Nan::ThrowError(error);
+        }
+
+        info.GetReturnValue().Set(size);
+      }
+
+      // serializev(message, minSegment) -> [buffer, ...] which concatenate
+      // to serialize(message).  String and bytes values given as Buffers of
+      // at least minSegment bytes (default 4096) appear in the list as they
+      // are, uncopied, for socket.writev() and the like.
+      static NAN_METHOD(SerializeV) {
+        static const size_t kDefaultMinSegment = 4096;
+
+        if ((info.Length() < 1) || (!info[0]->IsObject())) {
+          return Nan::ThrowTypeError("Not an object");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        SerializeScratch scratch;
+        scratch.gather = kDefaultMinSegment;
+        if (!info[1]->IsUndefined()) {
+          double min_segment = info[1]->NumberValue();
+          if (!(min_segment >= 1)) {
+            return Nan::ThrowRangeError("minSegment should be a positive number");
+          }
+          scratch.gather = min_segment < INT_MAX ? static_cast<size_t>(min_segment) : INT_MAX;
+        }
+
+        int size;
+        const char* error = type->ComputeSize(info[0].As<Object>(), &scratch, &size);
+        if (error) {
+          return Nan::ThrowError(error);
+        }
+
+        size_t length = size - scratch.gathered;
+        Local<Object> output = Nan::NewBuffer(length).ToLocalChecked();
+        uint8* start = reinterpret_cast<uint8*>(node::Buffer::Data(output));
+        if (type->WriteTo(&scratch, start, start + length) != start + length ||
+            scratch.skipped != scratch.gathered) {
+          return Nan::ThrowError(E_CHANGED);
+        }
+
+        Local<Array> result = Nan::New<Array>();
+        if (scratch.segments.empty()) {
+          result->Set(0, output);
+          return info.GetReturnValue().Set(result);
+        }
 
-          properties->Set(i, value);
+        // the output, cut where the gathered Buffers go
+        Local<Function> slice =
+          output->Get(Nan::New<String>("slice").ToLocalChecked()).As<Function>();
+        size_t offset = 0;
+        for (size_t i = 0; i <= scratch.segments.size(); i++) {
+          size_t next = i < scratch.segments.size() ?
+            scratch.segments[i].first - start : length;
+          if (next > offset) {
+            Local<Value> argv[] = {
+              Nan::New<Number>(offset),
+              Nan::New<Number>(next)
+            };
+            result->Set(result->Length(), slice->Call(output, 2, argv));
+          }
+          if (i < scratch.segments.size()) {
+            result->Set(result->Length(), scratch.segments[i].second);
+          }
+          offset = next;
         }
 
-        return NewObject(properties);
+        info.GetReturnValue().Set(result);
       }
 
-      static NAN_METHOD(Parse) {
-        if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
-          return Nan::ThrowTypeError("Argument should be a buffer");
+      // serializeDelimited([message, ...]) -> buffer of varint
+      // length-prefixed messages, written in one pass.
+      static NAN_METHOD(SerializeDelimited) {
+        if ((info.Length() < 1) || (!info[0]->IsArray())) {
+          return Nan::ThrowTypeError(E_NO_ARRAY);
         }
 
-        Local<Object> buffer_obj = info[0]->ToObject();
-
         Type *type = Unwrap<Type>(info.This());
-        Message* message = type->NewMessage();
-        bool success =
-          message->ParseFromArray(node::Buffer::Data(buffer_obj), node::Buffer::Length(buffer_obj));
+        Local<Array> messages = info[0].As<Array>();
+        int count = messages->Length();
+
+        SerializeScratch scratch;
+        vector<int> sizes(count);
+        uint64 total = 0;
+        for (int i = 0; i < count; i++) {
+          Local<Value> message = messages->Get(i);
+          if (!message->IsObject()) {
+            return Nan::ThrowTypeError(E_NO_OBJECT);
+          }
+          const char* error = type->ComputeSize(message.As<Object>(), &scratch, &sizes[i]);
+          if (error) {
+            return Nan::ThrowError(error);
+          }
+          total += CodedOutputStream::VarintSize32(sizes[i]) + sizes[i];
+        }
+        if (total > node::Buffer::kMaxLength) {
+          return Nan::ThrowRangeError("Buffer too large");
+        }
 
-        if (!success) {
-          return Nan::ThrowError("Malformed message");
+        Local<Object> result = Nan::NewBuffer(static_cast<uint32_t>(total)).ToLocalChecked();
+        uint8* target = reinterpret_cast<uint8*>(node::Buffer::Data(result));
+        for (int i = 0; target && i < count; i++) {
+          target = CodedOutputStream::WriteVarint32ToArray(sizes[i], target);
+          uint8* end = target + sizes[i];
+          if (type->WriteTo(&scratch, target, end) != end) target = NULL;
+          else target = end;
+        }
+        if (!target) {
+          return Nan::ThrowError(E_CHANGED);
         }
 
-        Local<Object> result = type->ToJs(*message);
-        delete message;
         info.GetReturnValue().Set(result);
       }
 
-#define SET(TYPE, EXPR)                                                 \
-      if (repeated) reflection->Add##TYPE(instance, field, EXPR);       \
-      else reflection->Set##TYPE(instance, field, EXPR)
-
-      static const char* ToProto(Message* instance,
-                                 const FieldDescriptor* field,
-                                 Local<Value> value,
-                                 const Type* type,
-                                 bool repeated) {
-        Nan::HandleScope scope;
+      // Decodes into a DynamicMessage on the libuv threadpool; only the
+      // conversion to JS runs on the loop thread.
+      class ParseWorker : public Nan::AsyncWorker {
+      public:
+        ParseWorker(Nan::Callback* callback, const Type* type,
+                    const ParseOptions& options, Local<Object> buffer)
+          : Nan::AsyncWorker(callback),
+            type_(type),
+            options_(options),
+            arena_(type->schema_->arena_ ? new DynamicMessageArena : NULL),
+            data_(node::Buffer::Data(buffer)),
+            length_(node::Buffer::Length(buffer)) {
+          // arena schemas give each worker an arena of its own, as the
+          // schema's is only used on the loop thread
+          DynamicMessageArena::Scope scope(arena_);
+          message_ = arena_ ? type->NewMessage() : type->AcquireMessage();
+          // keep the type (and with it the schema) and the input alive
+          SaveToPersistent("type", const_cast<Type*>(type)->handle());
+          SaveToPersistent("buffer", buffer);
+        }
 
-        const Reflection* reflection = instance->GetReflection();
-        switch (field->cpp_type()) {
-        case FieldDescriptor::CPPTYPE_MESSAGE:
-          if (!value->IsObject()) {
-            return E_NO_OBJECT;
-          }
-          type->ToProto(repeated ?
-                        reflection->AddMessage(instance, field) :
-                        reflection->MutableMessage(instance, field),
-                        value.As<Object>());
-          break;
-        case FieldDescriptor::CPPTYPE_STRING: {
-          // Shortcutting Utf8value(buffer.toString())
-          if (node::Buffer::HasInstance(value)) {
-            Local<Object> buf = value->ToObject();
-            SET(String, string(node::Buffer::Data(buf), node::Buffer::Length(buf)));
+        virtual ~ParseWorker() {
+          if (arena_) {
+            delete message_;
+            delete arena_;
           } else {
-            String::Utf8Value utf8(value);
-            SET(String, string(*utf8, utf8.length()));
+            type_->ReleaseMessage(message_);
           }
-          break;
         }
-        case FieldDescriptor::CPPTYPE_INT32:
-          SET(Int32, value->Int32Value());
-          break;
-        case FieldDescriptor::CPPTYPE_UINT32:
-          SET(UInt32, value->Uint32Value());
-          break;
-        case FieldDescriptor::CPPTYPE_INT64:
-          if (value->IsString()) {
-            google::protobuf::int64 ll;
-            std::istringstream(*String::Utf8Value(value)) >> ll;
-            SET(Int64, ll);
-          } else {
-            SET(Int64, value->NumberValue());
-          }
-          break;
-        case FieldDescriptor::CPPTYPE_UINT64:
-          if (value->IsString()) {
-            google::protobuf::uint64 ull;
-            std::istringstream(*String::Utf8Value(value)) >> ull;
-            SET(UInt64, ull);
-          } else {
-            SET(UInt64, value->NumberValue());
+
+        // in some thread:
+        virtual void Execute() {
+          DynamicMessageArena::Scope scope(arena_);
+          if (!message_->ParseFromArray(data_, length_)) {
+            SetErrorMessage("Malformed message");
           }
-          break;
-        case FieldDescriptor::CPPTYPE_FLOAT:
-          SET(Float, value->NumberValue());
-          break;
-        case FieldDescriptor::CPPTYPE_DOUBLE:
-          SET(Double, value->NumberValue());
-          break;
-        case FieldDescriptor::CPPTYPE_BOOL:
-          SET(Bool, value->BooleanValue());
-          break;
-        case FieldDescriptor::CPPTYPE_ENUM:
-          const google::protobuf::EnumValueDescriptor* enum_value =
-            value->IsNumber() ?
-            field->enum_type()->FindValueByNumber(value->Int32Value()) :
-            field->enum_type()->FindValueByName(*String::Utf8Value(value));
-          if (!enum_value) {
-            return E_UNKNOWN_ENUM;
-          }
-          SET(Enum, enum_value);
-          break;
         }
 
-        return NULL;
-      }
-#undef SET
+      protected:
+        // main thread:
+        virtual void HandleOKCallback() {
+          Nan::HandleScope scope;
+          Local<Value> argv[] = { Nan::Null(), type_->ToJs(*message_, ParseContext(options_)) };
+          callback->Call(2, argv);
+        }
 
-      const char* ToProto(Message* instance, Local<Object> src) const {
-        Local<Object> handle = const_cast<Type *>(this)->handle();
-        Local<Function> to_array = handle->GetInternalField(3).As<Function>();
-        Local<Array> properties = to_array->Call(src, 0, NULL).As<Array>();
+      private:
+        const Type* type_;
+        ParseOptions options_;
+        DynamicMessageArena* arena_;  // or NULL for the pool
+        Message* message_;
+        const char* data_;
+        size_t length_;
+      };
+
+      // Encodes a DynamicMessage, filled on the loop thread, into a
+      // malloc'ed array on the libuv threadpool.
+      class SerializeWorker : public Nan::AsyncWorker {
+      public:
+        SerializeWorker(Nan::Callback* callback, const Type* type,
+                        Message* message, const char* error)
+          : Nan::AsyncWorker(callback),
+            type_(type),
+            message_(message),
+            error_(error),
+            data_(NULL),
+            size_(0) {
+          SaveToPersistent("type", const_cast<Type*>(type)->handle());
+        }
 
-        const char* error = NULL;
-        for (int i = 0; !error && i < descriptor_->field_count(); i++) {
-          Local<Value> value = properties->Get(i);
-          if (value->IsUndefined() ||
-              value->IsNull()) continue;
+        virtual ~SerializeWorker() {
+          type_->ReleaseMessage(message_);
+          free(data_);
+        }
 
-          const FieldDescriptor* field = descriptor_->field(i);
-          const Type* child_type =
-            (field->cpp_type() == FieldDescriptor::CPPTYPE_MESSAGE) ?
-            schema_->GetType(field->message_type()) : NULL;
-          if (field->is_repeated()) {
-            if(!value->IsArray()) {
-              error = E_NO_ARRAY;
-              continue;
-            }
+        // in some thread:
+        virtual void Execute() {
+          if (error_) {
+            SetErrorMessage(error_);
+            return;
+          }
+          size_ = message_->ByteSize();
+          data_ = static_cast<char*>(malloc(size_ ? size_ : 1));
+          message_->SerializeWithCachedSizesToArray(reinterpret_cast<uint8*>(data_));
+        }
 
-            Local<Array> array = value.As<Array>();
-            int length = array->Length();
+      protected:
+        // main thread:
+        virtual void HandleOKCallback() {
+          Nan::HandleScope scope;
+          // the buffer takes ownership of data_
+          Local<Value> argv[] = { Nan::Null(), Nan::NewBuffer(data_, size_).ToLocalChecked() };
+          data_ = NULL;
+          callback->Call(2, argv);
+        }
 
-            for (int j = 0; !error && j < length; j++) {
-              error = ToProto(instance, field, array->Get(j), child_type, true);
-            }
-          } else {
-            error = ToProto(instance, field, value, child_type, false);
-          }
+      private:
+        const Type* type_;
+        Message* message_;
+        const char* error_;
+        char* data_;
+        int size_;
+      };
+
+      // Async methods are called as (arg, options, callback).
+      static NAN_METHOD(ParseAsync) {
+        if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
         }
-        return error;
+        if ((info.Length() < 3) || (!info[2]->IsFunction())) {
+          return Nan::ThrowTypeError("Callback should be a function");
+        }
+
+        Type *type = Unwrap<Type>(info.This());
+        ParseOptions options;
+        Local<Object> mask_owner;
+        const char* error = type->ParseOptionsOf(info[1], &options, &mask_owner);
+        if (error) {
+          return Nan::ThrowTypeError(error);
+        }
+
+        ParseWorker* worker = new ParseWorker(new Nan::Callback(info[2].As<Function>()),
+                                              type, options, info[0]->ToObject());
+        if (!mask_owner.IsEmpty()) worker->SaveToPersistent("mask", mask_owner);
+        Nan::AsyncQueueWorker(worker);
       }
 
-      static NAN_METHOD(Serialize) {
+      static NAN_METHOD(SerializeAsync) {
         if ((info.Length() < 1) || (!info[0]->IsObject())) {
           return Nan::ThrowTypeError("Not an object");
         }
+        // there are no serialize options yet; the slot matches parseAsync
+        if (!info[1]->IsUndefined() && !info[1]->IsObject()) {
+          return Nan::ThrowTypeError("Options should be an object");
+        }
+        if ((info.Length() < 3) || (!info[2]->IsFunction())) {
+          return Nan::ThrowTypeError("Callback should be a function");
+        }
 
+        // Reading the JS object has to happen here, on the loop thread.
         Type *type = Unwrap<Type>(info.This());
-        Message* message = type->NewMessage();
+        Message* message = type->AcquireMessage();
         const char* error = type->ToProto(message, info[0].As<Object>());
-        Local<Object> result;
-        if (!error) {
-          result = Nan::NewBuffer(message->ByteSize()).ToLocalChecked();
-          message->SerializeWithCachedSizesToArray(
-              (google::protobuf::uint8*)node::Buffer::Data(result));
-        }
-        delete message;
-
-        if (error) {
-          return Nan::ThrowError(error);
-        }
+        Nan::AsyncQueueWorker(new SerializeWorker(new Nan::Callback(info[2].As<Function>()),
+                                                  type, message, error));
+      }
 
+      // poolStats() -> { size, hits, misses, discards } for this type
+      static NAN_METHOD(PoolStats) {
+        Type *type = Unwrap<Type>(info.This());
+        const MessagePool& pool = type->schema_->pools_[type->index_];
+        Local<Object> result = Nan::New<Object>();
+        Nan::Set(result, Nan::New<String>("size").ToLocalChecked(),
+                 Nan::New<Number>(pool.messages.size()));
+        Nan::Set(result, Nan::New<String>("hits").ToLocalChecked(),
+                 Nan::New<Number>(pool.hits));
+        Nan::Set(result, Nan::New<String>("misses").ToLocalChecked(),
+                 Nan::New<Number>(pool.misses));
+        Nan::Set(result, Nan::New<String>("discards").ToLocalChecked(),
+                 Nan::New<Number>(pool.discards));
         info.GetReturnValue().Set(result);
       }
 
@@ -421,13 +3018,88 @@ namespace protobuf_for_node {
       return factory_.GetPrototype(descriptor)->New();
     }
 
+    const EnumTable* GetEnumTable(const EnumDescriptor* descriptor) {
+      EnumTable*& table = enums_[descriptor];
+      if (!table) table = new EnumTable(descriptor);
+      return table;
+    }
+
+    // Cleared messages kept for reuse, one pool per type index.  Clear()
+    // keeps sub-messages and the capacity of strings and repeated fields,
+    // so steady traffic on a schema stops allocating.  Pools live here
+    // rather than in the Types since the messages must not outlive
+    // factory_.  Only touched from the loop thread.
+    struct MessagePool {
+      vector<Message*> messages;
+      double hits;
+      double misses;
+      double discards;
+
+      MessagePool() : hits(0), misses(0), discards(0) {}
+    };
+
+    Message* AcquireMessage(int index, const Descriptor* descriptor) {
+      MessagePool& pool = pools_[index];
+      if (pool.messages.empty()) {
+        pool.misses++;
+        return NewMessage(descriptor);
+      }
+      pool.hits++;
+      Message* message = pool.messages.back();
+      pool.messages.pop_back();
+      return message;
+    }
+
+    void ReleaseMessage(int index, Message* message) {
+      MessagePool& pool = pools_[index];
+      if (pool.messages.size() >= pool_size_) {
+        pool.discards++;
+        delete message;
+        return;
+      }
+      message->Clear();
+      pool.messages.push_back(message);
+    }
+
+    // Types are kept in a dense table; every message type gets a small
+    // index the first time it is seen (for schemas built from a
+    // FileDescriptorSet, all of them up front).
+    int IndexOf(const Descriptor* descriptor) {
+      hash_map<const Descriptor*, int>::const_iterator it = indices_.find(descriptor);
+      if (it != indices_.end()) return it->second;
+
+      int index = types_.size();
+      indices_[descriptor] = index;
+      names_[descriptor->full_name()] = index;
+      types_.push_back(NULL);
+      pools_.push_back(MessagePool());
+      return index;
+    }
+
+    void IndexMessage(const Descriptor* descriptor) {
+      IndexOf(descriptor);
+      for (int i = 0; i < descriptor->nested_type_count(); i++) {
+        IndexMessage(descriptor->nested_type(i));
+      }
+    }
+
+    void IndexFile(const FileDescriptor* file) {
+      for (int i = 0; i < file->message_type_count(); i++) {
+        IndexMessage(file->message_type(i));
+      }
+    }
+
     Type* GetType(const Descriptor* descriptor) {
-      Type* result = types_[descriptor];
+      return GetType(IndexOf(descriptor), descriptor);
+    }
+
+    Type* GetType(int index, const Descriptor* descriptor) {
+      Type* result = types_[index];
       if (result) return result;
 
       Local<FunctionTemplate> typeTemplate = Nan::New(TypeTemplate);
-      result = types_[descriptor] =
-        new Type(this, descriptor, Nan::NewInstance(typeTemplate->GetFunction()).ToLocalChecked());
+      result = types_[index] =
+        new Type(this, descriptor, index, Nan::NewInstance(typeTemplate->GetFunction()).ToLocalChecked());
 
       // managed schema->[type] link
       //
@@ -437,15 +3109,54 @@ namespace protobuf_for_node {
       return result;
     }
 
+    // Creates every indexed Type and links all message fields to their
+    // child Types, so that no Type is built while serving a request.
+    void Materialize() {
+      vector<const Descriptor*> descriptors(types_.size());
+      for (hash_map<const Descriptor*, int>::const_iterator it = indices_.begin();
+           it != indices_.end(); ++it) {
+        descriptors[it->second] = it->first;
+      }
+      for (size_t i = 0; i < descriptors.size(); i++) {
+        GetType(i, descriptors[i]);
+      }
+      for (size_t i = 0; i < types_.size(); i++) {
+        const Type* type = types_[i];
+        for (int j = 0; j < type->descriptor_->field_count(); j++) {
+          if (type->fields_[j].message) type->ChildType(type->fields_[j]);
+        }
+      }
+    }
+
     const DescriptorPool* pool_;
-    map<const Descriptor*, Type*> types_;
+    EncodedDescriptorDatabase* database_;  // behind a snapshot's pool, or NULL
+    vector<Type*> types_;
+    vector<MessagePool> pools_;
+    size_t pool_size_;  // per type
+    DynamicMessageArena* arena_;  // for synchronous parses, or NULL
+    int arena_scratch_;  // scratch Messages currently in arena_
+    hash_map<const EnumDescriptor*, EnumTable*> enums_;
+    ParseOptions parse_options_;
+    hash_map<const Descriptor*, int> indices_;
+    hash_map<string, int> names_;  // full name -> index
     DynamicMessageFactory factory_;
 
     static NAN_PROPERTY_GETTER(GetType) {
       Schema *schema = Unwrap<Schema>(info.This());
-      const Descriptor* descriptor =
-        schema->pool_->FindMessageTypeByName(*String::Utf8Value(property));
+      Nan::Utf8String name(property);
+
+      hash_map<string, int>::const_iterator it =
+        schema->names_.find(string(*name, name.length()));
+      if (it != schema->names_.end()) {
+        Type* type = schema->types_[it->second];
+        if (!type) {
+          type = schema->GetType(schema->pool_->FindMessageTypeByName(it->first));
+        }
+        info.GetReturnValue().Set(type->Constructor());
+        return;
+      }
 
+      const Descriptor* descriptor = schema->pool_->FindMessageTypeByName(*name);
       if (descriptor != NULL) {
         info.GetReturnValue().Set(schema->GetType(descriptor)->Constructor());
         return;
@@ -454,6 +3165,61 @@ namespace protobuf_for_node {
       info.GetReturnValue().SetUndefined();
     }
 
+    static Local<Value> OptionValue(Local<Value> options, const char* name) {
+      if (!options->IsObject()) return Nan::Undefined();
+      return options.As<Object>()->Get(Nan::New<String>(name).ToLocalChecked());
+    }
+
+    static bool BooleanOption(Local<Value> options, const char* name) {
+      return OptionValue(options, name)->BooleanValue();
+    }
+
+    // Overrides "out" with whatever "options" sets.
+    static const char* ReadParseOptions(Local<Value> options, ParseOptions* out) {
+      Local<Value> zero_copy = OptionValue(options, "zeroCopy");
+      if (!zero_copy->IsUndefined()) out->zero_copy = zero_copy->BooleanValue();
+
+      Local<Value> dense = OptionValue(options, "dense");
+      if (!dense->IsUndefined()) out->dense = dense->BooleanValue();
+
+      Local<Value> lazy = OptionValue(options, "lazy");
+      if (!lazy->IsUndefined()) out->lazy = lazy->BooleanValue();
+
+      Local<Value> typed_arrays = OptionValue(options, "typedArrays");
+      if (!typed_arrays->IsUndefined()) out->typed_arrays = typed_arrays->BooleanValue();
+
+      // { int64: 'string' | 'number' | 'bigint' }
+      Local<Value> int64 = OptionValue(options, "int64");
+      if (!int64->IsUndefined()) {
+        Nan::Utf8String mode(int64);
+        if (!strcmp(*mode, "string")) {
+          out->int64 = INT64_STRING;
+        } else if (!strcmp(*mode, "number")) {
+          out->int64 = INT64_NUMBER;
+#if PROTOBUF_FOR_NODE_BIGINT
+        } else if (!strcmp(*mode, "bigint")) {
+          out->int64 = INT64_BIGINT;
+#endif
+        } else {
+          return E_INT64_MODE;
+        }
+      }
+
+      // { enums: 'string' | 'number' }
+      Local<Value> enums = OptionValue(options, "enums");
+      if (!enums->IsUndefined()) {
+        Nan::Utf8String mode(enums);
+        if (!strcmp(*mode, "string")) {
+          out->enum_numbers = false;
+        } else if (!strcmp(*mode, "number")) {
+          out->enum_numbers = true;
+        } else {
+          return E_ENUM_MODE;
+        }
+      }
+      return NULL;
+    }
+
     static NAN_METHOD(NewSchema) {
       Schema *schema;
 
@@ -463,26 +3229,424 @@ namespace protobuf_for_node {
         return;
       }
 
-      if (!node::Buffer::HasInstance(info[0])) {
-        return Nan::ThrowTypeError("Argument should be a buffer");
+      if (info[0]->IsExternal()) {
+        // from fromProto(), which built the pool off the loop thread
+        BuiltPool* built = static_cast<BuiltPool*>(info[0].As<External>()->Value());
+        schema = new Schema(info.This(), built->pool);
+        built->pool = NULL;
+        for (size_t i = 0; i < built->files.size(); i++) {
+          schema->IndexFile(built->files[i]);
+        }
+      } else {
+        if (!node::Buffer::HasInstance(info[0])) {
+          return Nan::ThrowTypeError("Argument should be a buffer");
+        }
+
+        Local<Object> buffer_obj = info[0]->ToObject();
+        char *buffer_data = node::Buffer::Data(buffer_obj);
+        size_t buffer_length = node::Buffer::Length(buffer_obj);
+
+        if (IsSnapshot(buffer_data, buffer_length)) {
+          EncodedDescriptorDatabase* database = new EncodedDescriptorDatabase;
+          vector<string> names;
+          if (!LoadSnapshot(buffer_data, buffer_length, database, &names)) {
+            delete database;
+            return Nan::ThrowError("Malformed snapshot");
+          }
+          // files are built from the snapshot on first use
+          DescriptorPool* pool = new DescriptorPool(database);
+          schema = new Schema(info.This(), pool);
+          schema->database_ = database;
+          // the database reads from the buffer
+          info.This()->SetInternalField(2, buffer_obj);
+          if (BooleanOption(info[1], "eager")) {
+            for (size_t i = 0; i < names.size(); i++) {
+              const FileDescriptor* file = pool->FindFileByName(names[i]);
+              if (file) schema->IndexFile(file);
+            }
+          }
+        } else {
+          FileDescriptorSet descriptors;
+          if (!descriptors.ParseFromArray(buffer_data, buffer_length)) {
+            return Nan::ThrowError("Malformed descriptor");
+          }
+
+          DescriptorPool* pool = new DescriptorPool;
+          schema = new Schema(info.This(), pool);
+          for (int i = 0; i < descriptors.file_size(); i++) {
+            const FileDescriptor* file = pool->BuildFile(descriptors.file(i));
+            if (file) schema->IndexFile(file);
+          }
+        }
+      }
+
+      // { poolSize: n } bounds the number of idle messages kept per type
+      Local<Value> pool_size = OptionValue(info[1], "poolSize");
+      if (pool_size->IsNumber() && pool_size->NumberValue() >= 0) {
+        schema->pool_size_ = static_cast<size_t>(pool_size->NumberValue());
+      }
+
+      const char* error = ReadParseOptions(info[1], &schema->parse_options_);
+      if (error) {
+        return Nan::ThrowTypeError(error);
+      }
+
+      // { arena: true } allocates the messages of fallback and async
+      // parses from arenas that are dropped after each call, instead of
+      // keeping them in the pool
+      if (BooleanOption(info[1], "arena")) {
+        schema->arena_ = new DynamicMessageArena;
+      }
+
+      // new Schema(descriptor, { eager: true }) builds all Types now
+      // rather than on first use.
+      if (BooleanOption(info[1], "eager")) {
+        schema->Materialize();
+      }
+
+      info.GetReturnValue().Set(schema->handle());
+    }
+
+    // A pool and the files built into it, handed from a FromProtoWorker
+    // to NewSchema.
+    struct BuiltPool {
+      DescriptorPool* pool;
+      vector<const FileDescriptor*> files;
+    };
+
+    // In-memory sources by name, then the include paths on disk.
+    class ProtoSourceTree : public SourceTree {
+    public:
+      map<string, string> sources;
+      DiskSourceTree disk;
+
+      virtual ZeroCopyInputStream* Open(const string& filename) {
+        map<string, string>::const_iterator it = sources.find(filename);
+        if (it != sources.end()) {
+          return new ArrayInputStream(it->second.data(), it->second.size());
+        }
+        return disk.Open(filename);
+      }
+    };
+
+    // Collects protoc style "file:line:column: message" lines.
+    class ProtoErrorCollector : public MultiFileErrorCollector {
+    public:
+      string errors;
+
+      virtual void AddError(const string& filename, int line, int column,
+                            const string& message) {
+        errors += filename;
+        if (line >= 0) {
+          // both are zero-based
+          errors += ":" + SimpleItoa(line + 1) + ":" + SimpleItoa(column + 1);
+        }
+        errors += ": " + message + "\n";
+      }
+    };
+
+    // Parses .proto files and builds their pool on the libuv threadpool;
+    // the Schema is created on the loop thread.
+    class FromProtoWorker : public Nan::AsyncWorker {
+    public:
+      FromProtoWorker(Nan::Callback* callback, Local<Value> options)
+        : Nan::AsyncWorker(callback) {
+        built_.pool = NULL;
+        SaveToPersistent("options", options);
+      }
+
+      virtual ~FromProtoWorker() {
+        delete built_.pool;
+      }
+
+      ProtoSourceTree source_tree;
+      vector<string> files;
+
+      // in some thread:
+      virtual void Execute() {
+        ProtoErrorCollector errors;
+        Importer importer(&source_tree, &errors);
+        vector<const FileDescriptor*> imported;
+        for (size_t i = 0; i < files.size(); i++) {
+          // like protoc, accept paths on disk under an include path
+          string virtual_file, shadowing_disk_file;
+          if (source_tree.sources.count(files[i]) == 0 &&
+              source_tree.disk.DiskFileToVirtualFile(
+                  files[i], &virtual_file, &shadowing_disk_file) ==
+                DiskSourceTree::SUCCESS) {
+            files[i] = virtual_file;
+          }
+          const FileDescriptor* file = importer.Import(files[i]);
+          if (file) imported.push_back(file);
+        }
+        if (!errors.errors.empty() || imported.size() < files.size()) {
+          // drop the final newline
+          string message = errors.errors.empty() ?
+            "Import failed" : errors.errors.substr(0, errors.errors.size() - 1);
+          SetErrorMessage(message.c_str());
+          return;
+        }
+
+        // The importer's pool dies with it, so the files are rebuilt into
+        // one the Schema can own.
+        built_.pool = new DescriptorPool;
+        std::set<const FileDescriptor*> copied;
+        for (size_t i = 0; i < imported.size(); i++) {
+          Copy(imported[i], &copied);
+        }
+      }
+
+    protected:
+      // main thread:
+      virtual void HandleOKCallback() {
+        Nan::HandleScope scope;
+        Local<Value> argv[] = { Nan::New<External>(&built_), GetFromPersistent("options") };
+        Nan::TryCatch try_catch;
+        Local<Object> schema;
+        if (!Nan::NewInstance(Nan::New(SchemaTemplate)->GetFunction(), 2, argv).ToLocal(&schema)) {
+          Local<Value> error = try_catch.Exception();
+          callback->Call(1, &error);
+          return;
+        }
+        Local<Value> result[] = { Nan::Null(), schema };
+        callback->Call(2, result);
+      }
+
+    private:
+      BuiltPool built_;
+
+      // Builds "file" after its dependencies.
+      void Copy(const FileDescriptor* file, std::set<const FileDescriptor*>* copied) {
+        if (!copied->insert(file).second) return;
+        for (int i = 0; i < file->dependency_count(); i++) {
+          Copy(file->dependency(i), copied);
+        }
+        FileDescriptorProto proto;
+        file->CopyTo(&proto);
+        const FileDescriptor* built = built_.pool->BuildFile(proto);
+        if (built) built_.files.push_back(built);
+      }
+    };
+
+    // Schema.fromProto(files, { includePaths: [...] }, callback) with
+    // "files" a file name, an array of them, or { name: source } for files
+    // held in memory.  Imports are looked up among the in-memory files
+    // first, then in the include paths (by default, the current
+    // directory).  The other options are those of new Schema().
+    static NAN_METHOD(FromProto) {
+      if ((info.Length() < 3) || (!info[2]->IsFunction())) {
+        return Nan::ThrowTypeError("Callback should be a function");
+      }
+
+      FromProtoWorker* worker =
+        new FromProtoWorker(new Nan::Callback(info[2].As<Function>()), info[1]);
+      if (info[0]->IsString()) {
+        worker->files.push_back(*Nan::Utf8String(info[0]));
+      } else if (info[0]->IsArray()) {
+        Local<Array> names = info[0].As<Array>();
+        for (uint32 i = 0; i < names->Length(); i++) {
+          worker->files.push_back(*Nan::Utf8String(names->Get(i)));
+        }
+      } else if (info[0]->IsObject()) {
+        Local<Object> sources = info[0].As<Object>();
+        Local<Array> names = sources->GetOwnPropertyNames();
+        for (uint32 i = 0; i < names->Length(); i++) {
+          string name = *Nan::Utf8String(names->Get(i));
+          worker->source_tree.sources[name] = *Nan::Utf8String(sources->Get(names->Get(i)));
+          worker->files.push_back(name);
+        }
+      } else {
+        delete worker;
+        return Nan::ThrowTypeError(E_PROTO_FILES);
+      }
+
+      Local<Value> include_paths = OptionValue(info[1], "includePaths");
+      if (include_paths->IsArray()) {
+        Local<Array> paths = include_paths.As<Array>();
+        for (uint32 i = 0; i < paths->Length(); i++) {
+          worker->source_tree.disk.MapPath("", *Nan::Utf8String(paths->Get(i)));
+        }
+      } else if (include_paths->IsString()) {
+        worker->source_tree.disk.MapPath("", *Nan::Utf8String(include_paths));
+      } else {
+        worker->source_tree.disk.MapPath("", ".");
+      }
+
+      Nan::AsyncQueueWorker(worker);
+    }
+
+    // Snapshots -----------------------------------------------------
+    //
+    // A snapshot holds the encoded files of a descriptor set, preceded by
+    // the index an EncodedDescriptorDatabase keeps of them (see
+    // EncodedDescriptorDatabase::MakeIndex()):
+    //
+    //   magic, varint size, FileDescriptorSet of indices,
+    //   { varint size, FileDescriptorProto } for each file
+    //
+    // so that loading one only reads the indices, and a file is parsed and
+    // built when one of its types is first asked for.
+
+    static bool IsSnapshot(const char* data, size_t length) {
+      return length >= kSnapshotMagicSize &&
+             memcmp(data, kSnapshotMagic, kSnapshotMagicSize) == 0;
+    }
+
+    // Reads a varint size and points "*data" at that many bytes.
+    static bool ReadSized(CodedInputStream* input, const void** data, uint32* size) {
+      int available;
+      if (!input->ReadVarint32(size)) return false;
+      if (*size == 0) {
+        *data = "";
+        return true;
+      }
+      return input->GetDirectBufferPointer(data, &available) &&
+             static_cast<uint32>(available) >= *size &&
+             input->Skip(*size);
+    }
+
+    // Adds the files of a snapshot to "database", which reads them from
+    // "data" from then on, and their names to "names".
+    static bool LoadSnapshot(const char* data, size_t length,
+                             EncodedDescriptorDatabase* database,
+                             vector<string>* names) {
+      if (length > INT_MAX) return false;
+      CodedInputStream input(reinterpret_cast<const uint8*>(data) + kSnapshotMagicSize,
+                             length - kSnapshotMagicSize);
+      input.SetTotalBytesLimit(INT_MAX, -1);
+      input.PushLimit(length - kSnapshotMagicSize);
+
+      const void* index_data;
+      uint32 index_size;
+      FileDescriptorSet index;
+      if (!ReadSized(&input, &index_data, &index_size) ||
+          !index.ParseFromArray(index_data, index_size)) {
+        return false;
+      }
+      for (int i = 0; i < index.file_size(); i++) {
+        const void* file_data;
+        uint32 file_size;
+        if (!ReadSized(&input, &file_data, &file_size) ||
+            !database->AddIndexed(index.file(i), file_data, file_size)) {
+          return false;
+        }
+        names->push_back(index.file(i).name());
       }
+      return input.BytesUntilLimit() == 0;
+    }
 
-      Local<Object> buffer_obj = info[0]->ToObject();
-      char *buffer_data = node::Buffer::Data(buffer_obj);
-      size_t buffer_length = node::Buffer::Length(buffer_obj);
+    // Schema.snapshot(descriptor) -> Buffer, for new Schema(snapshot) or
+    // Schema.load(path).  Files that don't build are left out, as they are
+    // by new Schema(descriptor).
+    static NAN_METHOD(Snapshot) {
+      if ((info.Length() < 1) || (!node::Buffer::HasInstance(info[0]))) {
+        return Nan::ThrowTypeError("Argument should be a buffer");
+      }
 
       FileDescriptorSet descriptors;
-      if (!descriptors.ParseFromArray(buffer_data, buffer_length)) {
+      if (!descriptors.ParseFromArray(node::Buffer::Data(info[0]),
+                                      node::Buffer::Length(info[0]))) {
         return Nan::ThrowError("Malformed descriptor");
       }
 
-      DescriptorPool* pool = new DescriptorPool;
-      for (int i = 0; i < descriptors.file_size(); i++) {
-        pool->BuildFile(descriptors.file(i));
+      DescriptorPool pool;
+      FileDescriptorSet index;
+      string files;
+      {
+        StringOutputStream stream(&files);
+        CodedOutputStream output(&stream);
+        for (int i = 0; i < descriptors.file_size(); i++) {
+          const FileDescriptorProto& file = descriptors.file(i);
+          if (!pool.BuildFile(file)) continue;
+          EncodedDescriptorDatabase::MakeIndex(file, index.add_file());
+          output.WriteVarint32(file.ByteSize());
+          file.SerializeWithCachedSizes(&output);
+        }
       }
 
-      schema = new Schema(info.This(), pool);
-      info.GetReturnValue().Set(schema->handle());
+      string result(kSnapshotMagic, kSnapshotMagicSize);
+      {
+        StringOutputStream stream(&result);
+        CodedOutputStream output(&stream);
+        output.WriteVarint32(index.ByteSize());
+        index.SerializeWithCachedSizes(&output);
+      }
+      result += files;
+      info.GetReturnValue().Set(
+        Nan::CopyBuffer(result.data(), result.size()).ToLocalChecked());
+    }
+
+#ifndef _WIN32
+    static void Unmap(char* data, void* hint) {
+      munmap(data, reinterpret_cast<size_t>(hint));
+    }
+#endif
+
+    // The contents of the file at "path" as a Buffer: mapped copy-on-write
+    // where possible, read otherwise.  Sets errno on failure.
+    static bool MapFile(const char* path, Local<Object>* buffer) {
+      int fd = open(path, O_RDONLY | O_BINARY);
+      if (fd < 0) return false;
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+        int saved_errno = errno;
+        close(fd);
+        errno = saved_errno;
+        return false;
+      }
+      size_t size = st.st_size;
+
+#ifndef _WIN32
+      if (size > 0) {
+        void* data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (data != MAP_FAILED) {
+          close(fd);
+          *buffer = Nan::NewBuffer(static_cast<char*>(data), size, Unmap,
+                                   reinterpret_cast<void*>(size)).ToLocalChecked();
+          return true;
+        }
+      }
+#endif
+
+      char* data = static_cast<char*>(malloc(size ? size : 1));
+      size_t done = 0;
+      while (done < size) {
+        int n = read(fd, data + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+          int saved_errno = n < 0 ? errno : EIO;
+          free(data);
+          close(fd);
+          errno = saved_errno;
+          return false;
+        }
+        done += n;
+      }
+      close(fd);
+      // the buffer takes ownership of data
+      *buffer = Nan::NewBuffer(data, size).ToLocalChecked();
+      return true;
+    }
+
+    // Schema.load(path, options) maps a snapshot (or descriptor set) file
+    // and builds the Schema from it, as new Schema(contents, options).
+    static NAN_METHOD(Load) {
+      if ((info.Length() < 1) || (!info[0]->IsString())) {
+        return Nan::ThrowTypeError("Argument should be a file name");
+      }
+
+      Nan::Utf8String path(info[0]);
+      Local<Object> buffer;
+      if (!MapFile(*path, &buffer)) {
+        return Nan::ThrowError(
+          (string("Cannot read ") + *path + ": " + strerror(errno)).c_str());
+      }
+
+      Local<Value> argv[] = { buffer, info[1] };
+      Local<Object> schema;
+      if (Nan::NewInstance(Nan::New(SchemaTemplate)->GetFunction(), 2, argv).ToLocal(&schema)) {
+        info.GetReturnValue().Set(schema);
+      }
     }
   };
 
@@ -692,15 +3856,19 @@ namespace protobuf_for_node {
     // owning schema (so GC can manage our lifecyle)
     // constructor
     // toArray
-    t->InstanceTemplate()->SetInternalFieldCount(4);
+    // dense constructor
+    t->InstanceTemplate()->SetInternalFieldCount(5);
     TypeTemplate.Reset(t);
 
     t = Nan::New<FunctionTemplate>(Schema::NewSchema);
     t->SetClassName(Nan::New<String>("Schema").ToLocalChecked());
     // native self
     // array of types (so GC can manage our lifecyle)
-    t->InstanceTemplate()->SetInternalFieldCount(2);
+    // snapshot buffer the pool reads from
+    t->InstanceTemplate()->SetInternalFieldCount(3);
     Nan::SetNamedPropertyHandler(t->InstanceTemplate(), Schema::GetType);
+    Nan::SetMethod(t, "snapshot", Schema::Snapshot);
+    Nan::SetMethod(t, "load", Schema::Load);
     SchemaTemplate.Reset(t);
 
     t = Nan::New<FunctionTemplate>();
@@ -724,13 +3892,117 @@ namespace protobuf_for_node {
     t = Nan::New<FunctionTemplate>(Schema::Type::Serialize);
     SerializeTemplate.Reset(t);
 
+    t = Nan::New<FunctionTemplate>(Schema::Type::SerializeInto);
+    SerializeIntoTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::ByteSize);
+    ByteSizeTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::SerializeV);
+    SerializeVTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::ParseMany);
+    ParseManyTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::ParseDelimited);
+    ParseDelimitedTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::SerializeDelimited);
+    SerializeDelimitedTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::PoolStats);
+    PoolStatsTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::Peek);
+    PeekTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::NewDecoder);
+    NewDecoderTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>();
+    t->SetClassName(Nan::New<String>("Decoder").ToLocalChecked());
+    // native self
+    // owning type
+    // Mask of the "fields" option, unless the type owns it
+    t->InstanceTemplate()->SetInternalFieldCount(3);
+    Nan::SetPrototypeMethod(t, "push", Schema::Type::Decoder::Push);
+    Nan::SetPrototypeMethod(t, "end", Schema::Type::Decoder::End);
+    DecoderTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::NewMask);
+    NewMaskTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>();
+    t->SetClassName(Nan::New<String>("Mask").ToLocalChecked());
+    // native self
+    // owning type
+    t->InstanceTemplate()->SetInternalFieldCount(2);
+    MaskTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::FromProto);
+    FromProtoTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::ParseAsync);
+    ParseAsyncTemplate.Reset(t);
+
+    t = Nan::New<FunctionTemplate>(Schema::Type::SerializeAsync);
+    SerializeAsyncTemplate.Reset(t);
+
+    // Lazy sub-messages keep their encoded bytes in a hidden map on the
+    // owning object until first read or assignment, which replaces the
+    // accessor with a plain property.  toArray prefers the bytes.
+    LazyHelper.Reset(Script::Compile(Nan::New<String>(
+        "(function() {"
+        "  var raw = Symbol('raw');"
+        "  function settle(object, name, value) {"
+        "    object[raw][name] = undefined;"
+        "    Object.defineProperty(object, name, {"
+        "      value: value, writable: true, enumerable: true, configurable: true"
+        "    });"
+        "    return value;"
+        "  }"
+        "  return {"
+        "    raw: raw,"
+        "    define: function(object, name, bytes, parse, options) {"
+        "      if (!Object.prototype.hasOwnProperty.call(object, raw))"
+        "        Object.defineProperty(object, raw, { value: {} });"
+        "      object[raw][name] = bytes;"
+        "      Object.defineProperty(object, name, {"
+        "        enumerable: true, configurable: true,"
+        "        get: function() { return settle(object, name, parse(bytes, options)); },"
+        "        set: function(value) { settle(object, name, value); }"
+        "      });"
+        "    }"
+        "  };"
+        "})()").ToLocalChecked())->Run().As<Object>());
+
     //WrappedService::Init();
   }
 
   Local<Function> SchemaConstructor() {
     Init();
     Local<FunctionTemplate> schemaTemplate = Nan::New(SchemaTemplate);
-    return schemaTemplate->GetFunction();
+    Local<Function> constructor = schemaTemplate->GetFunction();
+
+    // Schema.fromProto(files[, options], callback), or a Promise without
+    // the callback
+    Local<Function> wrap_async =
+      Script::Compile(Nan::New<String>(
+          "(function(f) {"
+          "  return function(files, options, cb) {"
+          "    if (typeof options === 'function') { cb = options; options = undefined; }"
+          "    if (typeof cb === 'function') return f(files, options, cb);"
+          "    return new Promise(function(resolve, reject) {"
+          "      f(files, options, function(err, result) {"
+          "        if (err) reject(err); else resolve(result);"
+          "      });"
+          "    });"
+          "  };"
+          "})").ToLocalChecked())->Run().As<Function>();
+    Local<Value> from_proto = Nan::New(FromProtoTemplate)->GetFunction();
+    constructor->Set(Nan::New<String>("fromProto").ToLocalChecked(),
+                     wrap_async->Call(wrap_async, 1, &from_proto));
+    return constructor;
   }
 
   void ExportService(Local<Object> target, const char* name, Service* service) {
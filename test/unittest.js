@@ -12,7 +12,8 @@ assert.bufferEqual = function(a, b, c) {
                 c);
 };
 
-var T = new Schema(read('test/unittest.desc'))['protobuf_unittest.TestAllTypes'];
+var schema = new Schema(read('test/unittest.desc'));
+var T = schema['protobuf_unittest.TestAllTypes'];
 assert.ok(T, 'type in schema');
 var golden = read('test/golden_message');
 var message = T.parse(golden);
@@ -105,4 +106,317 @@ assert.equal(T.parse(
   })
 ).optionalString, 'f\u0000o');
 
+var Packed = schema['protobuf_unittest.TestPackedTypes'];
+var Unpacked = schema['protobuf_unittest.TestUnpackedTypes'];
+assert.deepEqual(Unpacked.parse(
+  Packed.serialize({
+    packedInt32: [1, -2, 300],
+    packedEnum: ['FOREIGN_BAZ']
+  })
+), {
+  unpackedInt32: [1, -2, 300],
+  unpackedEnum: ['FOREIGN_BAZ']
+}, 'packed and unpacked are interchangeable');
+
+assert.deepEqual(schema['protobuf_unittest.TestEmptyMessage'].parse(golden), {},
+                 'unknown fields are skipped');
+
+assert.throws(function() {
+  schema['protobuf_unittest.TestRequired'].parse(new Buffer([8, 1]));
+}, Error, 'Missing required fields');
+
+var merged = schema['protobuf_unittest.TestRecursiveMessage'].parse(
+  new Buffer([0x0a, 0x02, 0x10, 0x01, 0x0a, 0x02, 0x0a, 0x00]));
+assert.strictEqual(merged.a.i, 1, 'singular messages merge');
+assert.ok(merged.a.a, 'singular messages merge');
+
+assert.throws(function() {
+  schema['protobuf_unittest.TestRecursiveMessage'].serialize({
+    a: { a: 3 }
+  });
+}, Error, 'Nested errors are reported');
+
+assert.deepEqual(T.parse(T.serialize({})), {}, 'empty message');
+
+var eager = new Schema(read('test/unittest.desc'), { eager: true });
+assert.bufferEqual(eager['protobuf_unittest.TestAllTypes'].serialize(
+  eager['protobuf_unittest.TestAllTypes'].parse(golden)), golden, 'eager schema');
+assert.strictEqual(eager['protobuf_unittest.NoSuchType'], undefined, 'unknown type');
+
+var snapshot = Schema.snapshot(read('test/unittest.desc'));
+var fromSnapshot = new Schema(snapshot)['protobuf_unittest.TestAllTypes'];
+assert.bufferEqual(fromSnapshot.serialize(fromSnapshot.parse(golden)), golden, 'snapshot schema');
+var snapshotFile = require('os').tmpdir() + '/protobuf_unittest.snapshot';
+require('fs').writeFileSync(snapshotFile, snapshot);
+var loaded = Schema.load(snapshotFile, { eager: true });
+require('fs').unlinkSync(snapshotFile);
+assert.bufferEqual(loaded['protobuf_unittest.TestAllTypes'].serialize(
+  loaded['protobuf_unittest.TestAllTypes'].parse(golden)), golden, 'loaded snapshot');
+assert.throws(function() {
+  new Schema(snapshot.slice(0, snapshot.length - 1));
+}, Error, 'truncated snapshot');
+
+T.parseAsync(golden, function(err, message) {
+  assert.ifError(err);
+  T.serializeAsync(message, function(err, buffer) {
+    assert.ifError(err);
+    assert.bufferEqual(buffer, golden, 'async roundtrip');
+  });
+});
+
+T.parseAsync(new Buffer('invalid'), function(err, message) {
+  assert.ok(err instanceof Error, 'async parse error');
+});
+
+assert.throws(function() {
+  T.serializeAsync({}, 'options', function() {});
+}, TypeError, 'async serialize options');
+
+if (typeof Promise !== 'undefined') {
+  T.serializeAsync({ optionalNestedEnum: 'foo' }).then(function() {
+    assert.fail('Unknown enum');
+  }, function(err) {
+    assert.ok(err instanceof Error, 'async serialize error');
+  });
+}
+
+Schema.fromProto({ 'inline.proto': 'package inline; message M { optional int32 a = 1; repeated string b = 2; }' },
+                 function(err, inline) {
+  assert.ifError(err);
+  var M = inline['inline.M'];
+  var m = M.parse(M.serialize({ a: 1, b: ['x'] }));
+  assert.strictEqual(m.a, 1, 'fromProto');
+  assert.deepEqual(m.b, ['x'], 'fromProto repeated');
+});
+Schema.fromProto({ 'broken.proto': 'message M { optional Nope a = 1; }' }, function(err) {
+  assert.ok(err instanceof Error && /^broken\.proto:1:/.test(err.message), 'fromProto error');
+});
+
+var many = T.parseMany([golden, golden]);
+assert.equal(many.length, 2, 'parseMany');
+assert.bufferEqual(T.serialize(many[1]), golden, 'parseMany roundtrip');
+assert.throws(function() {
+  T.parseMany([golden, new Buffer('invalid')]);
+}, Error, 'parseMany malformed');
+
+var prefix = new Buffer([golden.length & 0x7f | 0x80, golden.length >> 7]);
+var delimited = T.parseDelimited(Buffer.concat([prefix, golden, new Buffer([0]), prefix, golden]));
+assert.equal(delimited.length, 3, 'parseDelimited');
+assert.deepEqual(delimited[1], {}, 'parseDelimited empty message');
+assert.bufferEqual(T.serialize(delimited[2]), golden, 'parseDelimited roundtrip');
+assert.throws(function() {
+  T.parseDelimited(prefix);
+}, Error, 'parseDelimited truncated');
+
+var stream = Buffer.concat([prefix, golden, new Buffer([0]), prefix, golden]);
+assert.bufferEqual(T.serializeDelimited(delimited), stream, 'serializeDelimited');
+assert.bufferEqual(T.serializeDelimited([]), new Buffer(0), 'serializeDelimited empty');
+
+var decoder = T.decoder(), decoded = [];
+for (var i = 0; i < stream.length; i += 100) {
+  decoded = decoded.concat(decoder.push(stream.slice(i, i + 100)));
+}
+decoder.end();
+assert.equal(decoded.length, 3, 'decoder');
+assert.bufferEqual(T.serializeDelimited(decoded), stream, 'decoder roundtrip');
+decoded = [];
+for (var i = 0; i < stream.length; i++) {
+  decoded = decoded.concat(decoder.push(stream.slice(i, i + 1)));
+}
+assert.equal(decoded.length, 3, 'decoder byte by byte');
+decoder.push(prefix);
+assert.throws(function() {
+  decoder.end();
+}, Error, 'decoder truncated');
+
+var pooled = new Schema(read('test/unittest.desc'), { poolSize: 1 });
+var R = pooled['protobuf_unittest.TestRecursiveMessage'];
+var merge = new Buffer([0x0a, 0x02, 0x10, 0x01, 0x0a, 0x02, 0x0a, 0x00]);
+R.parse(merge);
+R.parse(merge);
+assert.deepEqual(R.poolStats(), { size: 1, hits: 1, misses: 1, discards: 0 }, 'message pool');
+R.parseMany([merge, merge]);
+assert.equal(R.poolStats().hits, 2, 'message pool reused across a batch');
+
+var arena = new Schema(read('test/unittest.desc'), { arena: true });
+var A = arena['protobuf_unittest.TestRecursiveMessage'];
+assert.deepEqual(A.parse(merge), R.parse(merge), 'arena parse');
+assert.deepEqual(A.parseMany([merge, merge]), [R.parse(merge), R.parse(merge)], 'arena batch');
+var reentered;
+Object.defineProperty(A.prototype, 'a', {
+  configurable: true,
+  set: function(value) {
+    // parses again while the outer scratch message is still being read
+    if (!reentered) reentered = A.parse(merge);
+    Object.defineProperty(this, 'a', { value: value, enumerable: true, writable: true });
+  }
+});
+assert.deepEqual(A.parse(merge), R.parse(merge), 'arena parse re-entered from JS');
+assert.deepEqual(reentered, R.parse(merge), 're-entrant arena parse');
+delete A.prototype.a;
+A.parseAsync(merge, function(err, message) {
+  assert.ifError(err);
+  assert.deepEqual(message, R.parse(merge), 'arena parseAsync');
+  assert.equal(A.poolStats().misses, 0, 'arena bypasses the pool');
+});
+
+var input = Buffer.concat([golden]);
+var view = T.parse(input, { zeroCopy: true });
+assert.bufferEqual(view.optionalBytes, T.parse(golden).optionalBytes, 'zero-copy bytes');
+assert.bufferEqual(T.serialize(view), golden, 'zero-copy roundtrip');
+view.optionalBytes[0] = 0x78;
+assert.equal(T.parse(input).optionalBytes.toString(), 'x16', 'zero-copy bytes share the input');
+assert.equal(new Schema(read('test/unittest.desc'), { zeroCopy: true })['protobuf_unittest.TestAllTypes']
+  .parseDelimited(stream)[0].repeatedBytes[1].buffer, stream.buffer, 'zero-copy schema default');
+
+var extremes = T.parse(T.serialize({
+  optionalInt64: '-9223372036854775808',
+  optionalUint64: '18446744073709551615',
+  optionalSint64: 42,
+  repeatedFixed64: ['0', ' 12']
+}));
+assert.strictEqual(extremes.optionalInt64, '-9223372036854775808', 'int64 min');
+assert.strictEqual(extremes.optionalUint64, '18446744073709551615', 'uint64 max');
+assert.strictEqual(extremes.optionalSint64, '42', 'int64 from number');
+assert.deepEqual(extremes.repeatedFixed64, ['0', '12'], 'int64 from padded string');
+
+var numbers = T.parse(T.serialize(extremes), { int64: 'number' });
+assert.strictEqual(numbers.optionalSint64, 42, 'int64 as number');
+assert.strictEqual(numbers.optionalInt64, '-9223372036854775808', 'inexact int64 stays a string');
+assert.strictEqual(new Schema(read('test/unittest.desc'), { int64: 'number' })['protobuf_unittest.TestAllTypes']
+  .parse(golden).optionalInt64, 102, 'int64 mode schema default');
+assert.strictEqual(new Schema(read('test/unittest.desc'), { int64: 'number' })['protobuf_unittest.TestAllTypes']
+  .parse(golden, { int64: 'string' }).optionalInt64, '102', 'int64 mode per call');
+assert.throws(function() {
+  T.parse(golden, { int64: 'float' });
+}, TypeError, 'unknown int64 mode');
+if (typeof BigInt === 'function') {
+  var bigints = T.parse(T.serialize(extremes), { int64: 'bigint' });
+  assert.strictEqual(typeof bigints.optionalUint64, 'bigint', 'int64 as bigint');
+  assert.strictEqual(T.parse(T.serialize(bigints)).optionalUint64, '18446744073709551615', 'bigint roundtrip');
+}
+
+var enums = T.parse(golden, { enums: 'number' });
+assert.strictEqual(enums.optionalNestedEnum, 3, 'enum as number');
+assert.deepEqual(enums.repeatedForeignEnum, [5, 6], 'repeated enum as number');
+assert.bufferEqual(T.serialize(enums), golden, 'numeric enums roundtrip');
+assert.strictEqual(T.parse(golden).optionalNestedEnum, 'BAZ', 'enum as name');
+assert.bufferEqual(T.serialize({ optionalNestedEnum: ['B', 'AZ'].join('') }),
+                   T.serialize({ optionalNestedEnum: 'BAZ' }), 'enum from a computed string');
+
+var sparse = T.parse(T.serialize({ optionalInt32: 1 }));
+var dense = T.parse(T.serialize({ optionalInt32: 1 }), { dense: true });
+assert.deepEqual(Object.keys(sparse), ['optionalInt32'], 'sparse result');
+assert.deepEqual(Object.keys(dense), Object.keys(T.parse(golden, { dense: true })), 'dense results share a shape');
+assert.strictEqual(dense.optionalInt64, undefined, 'dense unset field');
+assert.ok(dense instanceof T, 'dense result is an instance');
+assert.bufferEqual(T.serialize(T.parse(golden, { dense: true })), golden, 'dense roundtrip');
+
+assert.bufferEqual(T.serialize(T.parse(golden, { lazy: true })), golden, 'untouched lazy roundtrip');
+var lazy = T.parse(golden, { lazy: true });
+assert.deepEqual(lazy.optionalNestedMessage, T.parse(golden).optionalNestedMessage, 'lazy sub-message');
+assert.deepEqual(lazy.repeatedNestedMessage, T.parse(golden).repeatedNestedMessage, 'lazy repeated sub-message');
+lazy.optionalNestedMessage.bb = 7;
+assert.strictEqual(T.parse(T.serialize(lazy)).optionalNestedMessage.bb, 7, 'modified lazy sub-message');
+assert.deepEqual(T.parse(golden, { lazy: true }), T.parse(golden), 'lazy parse');
+var RequiredForeign = schema['protobuf_unittest.TestRequiredForeign'];
+var complete = new Buffer([0x12, 0x07, 0x08, 0x01, 0x18, 0x02, 0x88, 0x02, 0x03]);
+assert.deepEqual(RequiredForeign.parse(complete, { lazy: true }), RequiredForeign.parse(complete),
+                 'lazy parse with required fields');
+assert.throws(function() {
+  RequiredForeign.parse(new Buffer([0x12, 0x02, 0x08, 0x01]), { lazy: true });
+}, /Malformed/, 'lazy parse checks required fields');
+assert.bufferEqual(T.serialize({ optionalNestedMessage: new Buffer([8, 1]) }),
+                   T.serialize({ optionalNestedMessage: { bb: 1 } }), 'encoded sub-message');
+
+assert.deepEqual(T.parse(golden, { fields: ['optionalInt32', 'optionalNestedMessage.bb', 'repeatedNestedMessage'] }),
+                 { optionalInt32: 101, optionalNestedMessage: { bb: 118 },
+                   repeatedNestedMessage: [{ bb: 218 }, { bb: 318 }] }, 'field mask');
+assert.deepEqual(schema['protobuf_unittest.TestRecursiveMessage'].parse(
+  new Buffer([0x0a, 0x02, 0x10, 0x01, 0x0a, 0x02, 0x0a, 0x00]), { fields: ['a.i'] }),
+  { a: { i: 1 } }, 'field mask on fallback parse');
+assert.throws(function() {
+  T.parse(golden, { fields: ['optionalInt32.bb'] });
+}, TypeError, 'field mask path');
+var mask = T.mask(['optionalInt32', 'optionalNestedMessage.bb']);
+assert.deepEqual(T.parse(golden, { fields: mask }), { optionalInt32: 101, optionalNestedMessage: { bb: 118 } },
+                 'precompiled field mask');
+assert.deepEqual(T.decoder({ fields: mask }).push(T.serializeDelimited([T.parse(golden)])),
+                 [{ optionalInt32: 101, optionalNestedMessage: { bb: 118 } }], 'precompiled field mask on decoder');
+assert.throws(function() {
+  schema['protobuf_unittest.TestRecursiveMessage'].parse(golden, { fields: mask });
+}, TypeError, 'field mask of another type');
+assert.throws(function() {
+  T.mask(['optionalInt32.bb']);
+}, TypeError, 'precompiled field mask path');
+var paths = [];
+for (var i = 0; i < 40; i++) {
+  // distinct lists; past the first few, masks are compiled per call
+  paths.push('optionalInt32');
+  assert.deepEqual(T.parse(golden, { fields: paths }), { optionalInt32: 101 }, 'uncached field mask');
+}
+
+assert.strictEqual(T.peek(golden, 'optionalInt32'), 101, 'peek scalar');
+assert.strictEqual(T.peek(golden, 'optionalNestedMessage.bb'), 118, 'peek nested');
+assert.throws(function() {
+  T.peek(golden, 'repeatedNestedMessage.bb');
+}, TypeError, 'peek through repeated');
+assert.deepEqual(T.peek(golden, 'repeatedForeignEnum'), ['FOREIGN_BAR', 'FOREIGN_BAZ'], 'peek repeated');
+assert.bufferEqual(T.peek(golden, 'optionalBytes'), new Buffer('116'), 'peek bytes');
+assert.strictEqual(T.peek(T.serialize({}), 'optionalInt32'), undefined, 'peek absent');
+assert.throws(function() { T.peek(golden, 'optionalInt32.x'); }, TypeError, 'peek path');
+
+var golden_message = T.parse(golden);
+assert.strictEqual(T.byteSize(golden_message), golden.length, 'byteSize');
+var out = new Buffer(2 * golden.length + 1);
+assert.strictEqual(T.serializeInto(golden_message, out, 1), golden.length, 'serializeInto');
+assert.strictEqual(T.serializeInto(golden_message, out, 1 + golden.length), golden.length, 'serializeInto at offset');
+assert.bufferEqual(out.slice(1), Buffer.concat([golden, golden]), 'serializeInto output');
+assert.throws(function() {
+  T.serializeInto(golden_message, out, golden.length + 2);
+}, RangeError, 'serializeInto overflow');
+
+var payload = new Buffer(5000);
+payload.fill(7);
+var segments = T.serializev({ optionalInt32: 1, optionalBytes: payload, optionalNestedMessage: { bb: 2 } });
+assert.strictEqual(segments.length, 3, 'serializev segments');
+assert.strictEqual(segments[1], payload, 'serializev keeps the payload');
+assert.bufferEqual(Buffer.concat(segments),
+                   T.serialize({ optionalInt32: 1, optionalBytes: payload, optionalNestedMessage: { bb: 2 } }),
+                   'serializev output');
+assert.bufferEqual(Buffer.concat(T.serializev(golden_message, 2)), golden, 'serializev roundtrip');
+
+['ascii', 'l\u00e4tin-1', '\u20ac uni\u00e7ode', ''].forEach(function(string) {
+  var serialized = T.serialize({ optionalString: string, repeatedString: [string, 'x'] });
+  assert.strictEqual(serialized.length, T.byteSize({ optionalString: string, repeatedString: [string, 'x'] }), 'string size');
+  assert.strictEqual(T.parse(serialized).optionalString, string, 'string roundtrip');
+  assert.deepEqual(T.parse(serialized).repeatedString, [string, 'x'], 'repeated string roundtrip');
+});
+
+var typed = T.parse(golden, { typedArrays: true });
+assert.ok(typed.repeatedDouble instanceof Float64Array, 'Float64Array');
+assert.ok(typed.repeatedSint32 instanceof Int32Array, 'Int32Array');
+assert.deepEqual(Array.prototype.slice.call(typed.repeatedFixed32), [207, 307], 'typed array contents');
+assert.bufferEqual(T.serialize(typed), golden, 'typed arrays roundtrip');
+T.parseAsync(golden, { typedArrays: true }, function(err, message) {
+  assert.ifError(err);
+  assert.deepEqual(Array.prototype.slice.call(message.repeatedFixed32), [207, 307], 'async typed array contents');
+  T.serializeAsync(message, function(err, buffer) {
+    assert.ifError(err);
+    assert.bufferEqual(buffer, golden, 'typed arrays async roundtrip');
+  });
+});
+var packed = Packed.serialize({ packedInt32: [-1, 2], packedSint32: [-3], packedFloat: [1.5], packedDouble: [0.25, 2] });
+var typedPacked = Packed.parse(packed, { typedArrays: true });
+assert.deepEqual(Array.prototype.slice.call(typedPacked.packedInt32), [-1, 2], 'packed Int32Array');
+assert.deepEqual(Array.prototype.slice.call(typedPacked.packedDouble), [0.25, 2], 'packed Float64Array');
+assert.bufferEqual(Packed.serialize(typedPacked), packed, 'packed typed arrays roundtrip');
+assert.bufferEqual(Packed.serialize({ packedDouble: new Float64Array([0.25, 2]) }),
+                   Packed.serialize({ packedDouble: [0.25, 2] }), 'serialize from a TypedArray');
+var conversions = 0;
+var shrinking = { valueOf: function() { return conversions++ ? 1 : 300; } };
+assert.throws(function() {
+  Packed.serialize({ packedInt32: [shrinking], packedSint32: [1, 2] });
+}, /changed during serialization/, 'packed run changed during serialization');
+
 puts('Success');